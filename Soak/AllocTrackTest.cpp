@@ -0,0 +1,389 @@
+/*
+	Allocation tracking test.
+
+	Runs the paths the per-frame exports take (dllmain.cpp) through ALLOCTRACK_SCOPE (AllocTrack.h)
+	from several threads, while wheels are connected and disconnected, the broker is published
+	and the haptics timer ticks:
+	- XInputGetState: borrowing a device slot or reading the broker, sampled trace scopes,
+	- XInputGetStateEx: the same, nested in its own scope, which counts the call instead,
+	- XInputSetState: borrowing a device slot and submitting to the haptics engine, or sending
+	  the vibration through the broker.
+	No call may allocate or take a lock once its thread is past the warm-up. Allocations and locks
+	are seen through interposed malloc and pthread functions, whether anything annotated them or not.
+	The tracking itself is then checked to catch plain malloc, operator new, std::mutex and
+	annotated locks made after the warm-up.
+
+	Built on Linux by CMakeLists.txt in this folder, alloctrack-test-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target alloctrack-test
+
+	Sanitizer builds keep their own malloc and pthread interceptors, so only operator new and
+	annotated locks are seen there.
+
+	Usage:
+		alloctrack-test [--threads=8] [--calls=1000000]
+
+	Exits with 1 if a check failed.
+*/
+
+#include "AllocTrack.h"
+#include "Broker.h"
+#include "DeviceSlots.h"
+#include "Haptics.h"
+#include "TestUtil.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef X1NPUT_ALLOC_TRACKING
+#error Build with -DX1NPUT_ALLOC_TRACKING
+#endif
+
+#define TEST_SLOT_COUNT					4
+#define TEST_REGION_NAME				"X1nputAllocTrackTest"
+#define TEST_WARMUP						16
+
+// Same sizes as XINPUT_STATE and XINPUT_CAPABILITIES
+struct TestState
+{
+	uint32_t words[BROKER_STATE_WORDS];
+};
+
+struct TestCaps
+{
+	uint32_t words[BROKER_CAPS_WORDS];
+};
+
+struct TestWheel
+{
+	uint32_t id;
+	std::atomic<uint32_t> packet;
+};
+
+static DeviceSlots<TestWheel, TEST_SLOT_COUNT> gSlots;
+static BrokerRegion* gBroker = NULL;
+static HapticsEngine gHaptics;
+
+static std::once_flag gInitOnce;
+static std::atomic<bool> gInitialized(false);
+static std::atomic<bool> gStop(false);
+
+#pragma region Simulated exports
+static void NullSink(void*, size_t, const HapticsFrame&)
+{
+}
+
+static void Initialize()
+{
+	TraceScope trace("InitHandleFunction");
+
+	TraceInit(1024, 4);
+
+	HapticsSettings settings;
+	settings.LTriggerStrength = 0.25f;
+	settings.RTriggerStrength = 0.25f;
+	settings.LMotorStrength = 1.0f;
+	settings.RMotorStrength = 1.0f;
+	settings.TriggerSwap = false;
+	settings.MotorSwap = false;
+	settings.UpdateRate = 500;
+	settings.AttackTime = 10;
+	settings.DecayTime = 60;
+	settings.TriggerPulseRate = 30;
+	HapticsBuildTables(settings, &gHaptics.tables);
+	HapticsReset(&gHaptics);
+	HapticsStart(&gHaptics, settings.UpdateRate, NullSink, NULL);
+
+	gInitialized.store(true, std::memory_order_release);
+}
+
+// Same shape as InitializeRacingWheel: a plain check once done, a lock only until then
+static void InitializeOnce()
+{
+	if (gInitialized.load(std::memory_order_acquire))
+		return;
+
+	ALLOCTRACK_NOTE_LOCK();
+	std::call_once(gInitOnce, Initialize);
+}
+
+static bool GetState(size_t index, bool reader, TestState* state)
+{
+	ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE);
+
+	InitializeOnce();
+
+	TraceScope trace("XInputGetState", TraceSample());
+
+	if (reader)
+		return BrokerRead(gBroker, index, state, static_cast<TestCaps*>(NULL));
+
+	DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT> wheel(gSlots, index);
+	if (wheel.Get() == NULL)
+		return false;
+
+	memset(state, 0, sizeof(*state));
+	state->words[0] = wheel->packet.fetch_add(1, std::memory_order_relaxed);
+	state->words[1] = wheel->id;
+	return true;
+}
+
+static bool GetStateEx(size_t index, bool reader, TestState* state)
+{
+	ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE_EX);
+
+	return GetState(index, reader, state);
+}
+
+static bool SetState(size_t index, bool reader, uint16_t leftSpeed, uint16_t rightSpeed)
+{
+	ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+
+	InitializeOnce();
+
+	TraceScope trace("XInputSetState", TraceSample());
+
+	if (reader)
+	{
+		TestState state;
+		if (!BrokerRead(gBroker, index, &state, static_cast<TestCaps*>(NULL)))
+			return false;
+		BrokerSubmitVibration(gBroker, index, leftSpeed, rightSpeed);
+		return true;
+	}
+
+	DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT> wheel(gSlots, index);
+	if (wheel.Get() == NULL)
+		return false;
+
+	HapticsSubmit(&gHaptics, index, leftSpeed, rightSpeed);
+	return true;
+}
+#pragma endregion
+
+#pragma region Background threads
+// Connects and disconnects wheels like RacingWheelAdded/RacingWheelRemoved, allocating freely
+static void HotplugThread()
+{
+	uint32_t id = 0;
+	while (!gStop.load(std::memory_order_relaxed))
+	{
+		size_t index = id % TEST_SLOT_COUNT;
+		TestWheel* wheel = NULL;
+		if ((id / TEST_SLOT_COUNT) % 2 == 0)
+		{
+			wheel = new TestWheel();
+			wheel->id = id;
+			wheel->packet.store(0, std::memory_order_relaxed);
+		}
+		delete DeviceSlotsExchange(gSlots, index, wheel);
+		++id;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	for (size_t i = 0; i < TEST_SLOT_COUNT; ++i)
+		delete DeviceSlotsExchange(gSlots, i, static_cast<TestWheel*>(NULL));
+}
+
+// The broker owner's loop: publish every slot, pick up the readers' vibration
+static void PublishThread()
+{
+	TestState state;
+	TestCaps caps;
+	memset(&caps, 0, sizeof(caps));
+	uint32_t packet = 0;
+
+	while (!gStop.load(std::memory_order_relaxed))
+	{
+		for (size_t i = 0; i < TEST_SLOT_COUNT; ++i)
+		{
+			memset(&state, 0, sizeof(state));
+			state.words[0] = ++packet;
+			BrokerPublish(gBroker, i, i % 2 == 0, state, caps);
+
+			uint16_t leftSpeed, rightSpeed;
+			if (BrokerTakeVibration(gBroker, i, &leftSpeed, &rightSpeed))
+				HapticsSubmit(&gHaptics, i, leftSpeed, rightSpeed);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+#pragma endregion
+
+static void CallingThread(int thread, int calls)
+{
+	bool reader = thread % 2 == 1;
+	TestState state;
+
+	for (int i = 0; i < calls; ++i)
+	{
+		size_t index = static_cast<size_t>(i + thread) % (TEST_SLOT_COUNT + 1);	// One past the end, like a game probing every user index
+		uint16_t speed = static_cast<uint16_t>(i * 37);
+
+		switch (i % 3)
+		{
+		case 0: GetState(index, reader, &state); break;
+		case 1: GetStateEx(index, reader, &state); break;
+		default: SetState(index, reader, speed, static_cast<uint16_t>(~speed)); break;
+		}
+	}
+}
+
+static void SteadyState(int threads, int calls)
+{
+	static_assert(TEST_SLOT_COUNT < BROKER_SLOT_COUNT, "Calls probe one index past the test slots");
+
+	std::thread hotplug(HotplugThread);
+	std::thread publish(PublishThread);
+	std::vector<std::thread> callers;
+	for (int i = 0; i < threads; ++i)
+		callers.emplace_back(CallingThread, i, calls);
+	for (size_t i = 0; i < callers.size(); ++i)
+		callers[i].join();
+
+	gStop.store(true, std::memory_order_relaxed);
+	hotplug.join();
+	publish.join();
+	HapticsStop(&gHaptics);
+
+	bool clean = true;
+	for (int i = 0; i < ALLOCTRACK_EXPORT_COUNT; ++i)
+	{
+		AllocTrackExport which = static_cast<AllocTrackExport>(i);
+		const AllocTrackStats& stats = AllocTrackGetStats(which);
+		printf("      %-18s %10llu calls, %llu allocations, %llu locks, %llu violations\n", AllocTrackExportName(which),
+			(unsigned long long)stats.calls.load(), (unsigned long long)stats.allocations.load(),
+			(unsigned long long)stats.locks.load(), (unsigned long long)stats.violations.load());
+		clean = clean && stats.violations.load() == 0 && stats.calls.load() > 0;
+	}
+
+	// GetStateEx goes through GetState, but only counts as GetStateEx
+	uint64_t calls0 = AllocTrackGetStats(ALLOCTRACK_GET_STATE).calls.load();
+	uint64_t calls1 = AllocTrackGetStats(ALLOCTRACK_GET_STATE_EX).calls.load();
+	uint64_t calls2 = AllocTrackGetStats(ALLOCTRACK_SET_STATE).calls.load();
+
+	Check(calls0 == static_cast<uint64_t>(threads) * ((calls + 2) / 3) && calls1 == static_cast<uint64_t>(threads) * ((calls + 1) / 3) &&
+		calls2 == static_cast<uint64_t>(threads) * (calls / 3), "every call was tracked once, under its outermost export");
+	Check(clean, "no export allocated or locked after its warm-up");
+}
+
+// Kept out of reach of the optimizer so the allocations aren't elided
+static int* volatile gAllocated = NULL;
+static void* volatile gMalloced = NULL;
+static std::mutex gMutex;
+
+static void DetectsViolations()
+{
+	const AllocTrackStats& stats = AllocTrackGetStats(ALLOCTRACK_SET_STATE);
+
+	// This thread hasn't called anything yet, its first calls may allocate
+	std::thread fresh([]()
+	{
+		ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+		gAllocated = new int(1);
+		delete gAllocated;
+		ALLOCTRACK_NOTE_LOCK();
+	});
+	fresh.join();
+	Check(stats.violations.load() == 0, "allocations and locks during the warm-up are allowed");
+
+	std::thread warm([]()
+	{
+		for (int i = 0; i < TEST_WARMUP; ++i)
+			SetState(0, false, 0, 0);
+
+		{
+			ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+			gAllocated = new int(1);
+			delete gAllocated;
+		}
+		{
+			ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+			ALLOCTRACK_NOTE_LOCK();
+		}
+#ifdef ALLOCTRACK_INTERPOSE
+		// Neither of these is annotated
+		{
+			ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+			gMalloced = malloc(16);
+			free(gMalloced);
+		}
+		{
+			ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+			std::lock_guard<std::mutex> lock(gMutex);
+		}
+#endif
+	});
+	warm.join();
+
+#ifdef ALLOCTRACK_INTERPOSE
+	const uint64_t expected = 2;
+#else
+	const uint64_t expected = 1;
+	printf("      sanitizer build, only operator new and annotated locks are seen\n");
+#endif
+
+	Check(stats.violations.load() == 2 * expected, "allocations and locks after the warm-up are violations");
+	Check(stats.allocations.load() == expected && stats.locks.load() == expected, "they are counted");
+}
+
+static void NestedScopes()
+{
+	const AllocTrackStats& outer = AllocTrackGetStats(ALLOCTRACK_GET_STATE_EX);
+	const AllocTrackStats& inner = AllocTrackGetStats(ALLOCTRACK_GET_STATE);
+	uint64_t outerViolations = outer.violations.load();
+	uint64_t innerCalls = inner.calls.load();
+	uint64_t innerViolations = inner.violations.load();
+
+	std::thread warm([]()
+	{
+		TestState state;
+		for (int i = 0; i < TEST_WARMUP; ++i)
+			GetStateEx(TEST_SLOT_COUNT, false, &state);
+
+		ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE_EX);
+		{
+			ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE);
+			gAllocated = new int(1);
+			delete gAllocated;
+		}
+	});
+	warm.join();
+
+	Check(inner.calls.load() == innerCalls && inner.violations.load() == innerViolations, "a nested scope doesn't count for its own export");
+	Check(outer.violations.load() == outerViolations + 1, "the outer export counts what the nested scope did");
+}
+
+int main(int argc, char** argv)
+{
+	int threads = std::max(1, ParseOption(argc, argv, "threads", 8));
+	int calls = std::max(TEST_WARMUP * 3, ParseOption(argc, argv, "calls", 1000000));
+
+	AllocTrackInstall(TEST_WARMUP);
+
+	BrokerUnlink(TEST_REGION_NAME);
+	gBroker = BrokerOpen(TEST_REGION_NAME);
+	Check(gBroker != NULL, "broker region opened");
+	if (!gBroker)
+		return 1;
+	Check(BrokerTryAcquire(gBroker, BrokerProcessId(), BrokerNow(), 500), "broker region owned");
+
+	SteadyState(threads, calls);
+	DetectsViolations();
+	NestedScopes();
+
+	BrokerRelease(gBroker, BrokerProcessId());
+	BrokerClose(gBroker);
+	BrokerUnlink(TEST_REGION_NAME);
+
+	return ReportFailures();
+}
@@ -0,0 +1,465 @@
+/*
+	Broker stress test.
+
+	Runs the shared-memory protocol (Broker.h) across forked processes on Linux (shm_open):
+	- several processes opening a fresh region at the same time must all get a valid mapping,
+	- reader processes hammer the slots while an owner process publishes, no read may be torn,
+	- an owner killed in the middle of a write is taken over once its heartbeat goes stale,
+	  and the new owner can write the slot the dead one left odd,
+	- of several processes noticing a stale or released owner at the same time, exactly one takes over,
+	- an owner releasing the region is taken over right away and its slots read as disconnected,
+	- a reader releasing leaves the owner and its slots alone,
+	- vibration submitted by a reader process reaches the owner, latest command first.
+
+	Built on Linux by CMakeLists.txt in this folder, broker-stress-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target broker-stress
+
+	The build points BROKER_ACQUIRE_HOOK at BrokerStressAcquireHook, which stretches the takeover
+	window so a race there shows up in every round.
+
+	Usage:
+		broker-stress [--readers=4] [--seconds=5] [--openers=16] [--contenders=4] [--rounds=500]
+
+	Exits with 1 if a check failed.
+*/
+
+#include "Broker.h"
+#include "TestUtil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STRESS_REGION_NAME				"X1nputBrokerStress"
+#define STRESS_OWNER_TIMEOUT			100			// Milliseconds
+#define STRESS_DEAD_OWNER				1			// init, never one of our processes
+#define STRESS_PREEMPTION				50			// Microseconds spent in BROKER_ACQUIRE_HOOK
+
+// Same sizes as XINPUT_STATE and XINPUT_CAPABILITIES
+struct StressState
+{
+	uint32_t words[BROKER_STATE_WORDS];
+};
+
+struct StressCaps
+{
+	uint32_t words[BROKER_CAPS_WORDS];
+};
+
+static void Fill(uint32_t value, StressState* state, StressCaps* caps)
+{
+	for (size_t i = 0; i < BROKER_STATE_WORDS; ++i)
+		state->words[i] = value;
+	for (size_t i = 0; i < BROKER_CAPS_WORDS; ++i)
+		caps->words[i] = ~value;
+}
+
+// A torn read mixes words of two different writes
+static bool Consistent(const StressState& state, const StressCaps& caps)
+{
+	for (size_t i = 0; i < BROKER_STATE_WORDS; ++i)
+	{
+		if (state.words[i] != state.words[0])
+			return false;
+	}
+	for (size_t i = 0; i < BROKER_CAPS_WORDS; ++i)
+	{
+		if (caps.words[i] != ~state.words[0])
+			return false;
+	}
+	return true;
+}
+
+static int WaitExitCode(pid_t child)
+{
+	int status = 0;
+	if (waitpid(child, &status, 0) != child)
+		return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static void SleepMs(int milliseconds)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+#pragma region Phases
+
+// Every opener waits on the same pipe so they all race for the fresh region together
+static void OpenRace(int openers)
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+
+	int start[2];
+	if (pipe(start) != 0)
+	{
+		Check(false, "pipe");
+		return;
+	}
+
+	std::vector<pid_t> children;
+	for (int i = 0; i < openers; ++i)
+	{
+		pid_t child = fork();
+		if (child == 0)
+		{
+			close(start[1]);
+			char go;
+			if (read(start[0], &go, 1) < 0)
+				_exit(3);
+
+			BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+			if (!region)
+				_exit(1);
+
+			bool valid = region->magic.load() == BROKER_MAGIC && region->version.load() == BROKER_VERSION;
+			BrokerClose(region);
+			_exit(valid ? 0 : 2);
+		}
+		children.push_back(child);
+	}
+
+	// Closing the write end wakes every opener at once
+	close(start[0]);
+	close(start[1]);
+
+	int failed = 0;
+	for (size_t i = 0; i < children.size(); ++i)
+	{
+		if (WaitExitCode(children[i]) != 0)
+			++failed;
+	}
+
+	printf("      %d of %d concurrent opens failed\n", failed, openers);
+	Check(failed == 0, "concurrent BrokerOpen on a fresh region");
+}
+
+// Owner process publishing a counter into every slot until killed
+static pid_t StartOwner(bool dieMidWrite)
+{
+	pid_t child = fork();
+	if (child != 0)
+		return child;
+
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+	uint32_t id = BrokerProcessId();
+	while (!region || !BrokerTryAcquire(region, id, BrokerNow(), STRESS_OWNER_TIMEOUT))
+		SleepMs(1);
+
+	for (uint32_t value = 1; ; ++value)
+	{
+		if ((value & 1023) == 0)
+			BrokerHeartbeat(region, BrokerNow());
+
+		StressState state;
+		StressCaps caps;
+		Fill(value, &state, &caps);
+		BrokerPublish(region, value % BROKER_SLOT_COUNT, true, state, caps);
+
+		// Leave slot 0 half written, as if the process died inside BrokerWriteSlot
+		if (dieMidWrite && value == 100000)
+		{
+			region->slots[0].sequence.fetch_add(1);
+			for (;;)
+				pause();
+		}
+	}
+}
+
+// Readers check every slot until the deadline, the exit code says whether anything was torn
+static pid_t StartReader(int milliseconds)
+{
+	pid_t child = fork();
+	if (child != 0)
+		return child;
+
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+	if (!region)
+		_exit(3);
+
+	uint64_t reads = 0;
+	uint64_t torn = 0;
+	uint64_t deadline = BrokerNow() + milliseconds;
+	while (BrokerNow() < deadline)
+	{
+		for (size_t i = 0; i < BROKER_SLOT_COUNT; ++i)
+		{
+			StressState state;
+			StressCaps caps;
+			if (BrokerRead(region, i, &state, &caps))
+			{
+				++reads;
+				if (!Consistent(state, caps))
+					++torn;
+			}
+		}
+	}
+
+	printf("      reader %d: %llu reads, %llu torn\n", getpid(), (unsigned long long)reads, (unsigned long long)torn);
+	_exit(torn != 0 ? 1 : (reads == 0 ? 2 : 0));
+}
+
+static void SeqlockAcrossProcesses(int readers, int seconds)
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+
+	pid_t owner = StartOwner(false);
+	while (region->ownerId.load() == 0)
+		SleepMs(1);
+
+	std::vector<pid_t> children;
+	for (int i = 0; i < readers; ++i)
+		children.push_back(StartReader(seconds * 1000));
+
+	int failed = 0;
+	for (size_t i = 0; i < children.size(); ++i)
+	{
+		if (WaitExitCode(children[i]) != 0)
+			++failed;
+	}
+
+	kill(owner, SIGKILL);
+	WaitExitCode(owner);
+	BrokerClose(region);
+
+	Check(failed == 0, "no torn reads while the owner publishes");
+}
+
+static void TakeoverAfterCrash()
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+
+	pid_t owner = StartOwner(true);
+	while ((region->slots[0].sequence.load() & 1) == 0)
+		SleepMs(1);
+
+	kill(owner, SIGKILL);
+	WaitExitCode(owner);
+
+	uint32_t id = BrokerProcessId();
+	uint32_t epoch = region->ownerEpoch.load();
+	uint64_t killed = BrokerNow();
+
+	Check(!BrokerTryAcquire(region, id, killed, STRESS_OWNER_TIMEOUT), "a fresh heartbeat keeps the dead owner");
+
+	while (!BrokerTryAcquire(region, id, BrokerNow(), STRESS_OWNER_TIMEOUT))
+		SleepMs(5);
+
+	printf("      taken over after %llums\n", (unsigned long long)(BrokerNow() - killed));
+	Check(BrokerIsOwner(region, id) && region->ownerEpoch.load() == epoch + 1, "stale owner taken over, epoch incremented");
+
+	StressState state;
+	StressCaps caps;
+	Fill(42, &state, &caps);
+	Check(BrokerPublish(region, 0, true, state, caps), "new owner can write the slot left odd");
+
+	StressState readState;
+	StressCaps readCaps;
+	Check(BrokerRead(region, 0, &readState, &readCaps) && Consistent(readState, readCaps) && readState.words[0] == 42, "slot readable again");
+
+	BrokerRelease(region, id);
+	BrokerClose(region);
+}
+
+// Stands in for a contender being preempted in the middle of BrokerTryAcquire
+void BrokerStressAcquireHook()
+{
+	usleep(STRESS_PREEMPTION);
+}
+
+// Every round, the contenders wake together and find a dead owner or a released region
+static void TakeoverRace(int contenders, int rounds)
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+
+	int contested = 0, unclaimed = 0, mismatched = 0;
+	for (int round = 0; round < rounds; ++round)
+	{
+		region->ownerId.store(round % 2 ? STRESS_DEAD_OWNER : 0);
+		region->heartbeat.store(BrokerNow() - 2 * STRESS_OWNER_TIMEOUT);
+
+		int start[2];
+		if (pipe(start) != 0)
+		{
+			Check(false, "pipe");
+			return;
+		}
+
+		// The mapping is shared, so the children use it as it is
+		std::vector<pid_t> children;
+		for (int i = 0; i < contenders; ++i)
+		{
+			pid_t child = fork();
+			if (child == 0)
+			{
+				close(start[1]);
+				char go;
+				if (read(start[0], &go, 1) < 0)
+					_exit(3);
+				_exit(BrokerTryAcquire(region, BrokerProcessId(), BrokerNow(), STRESS_OWNER_TIMEOUT) ? 0 : 1);
+			}
+			children.push_back(child);
+		}
+
+		close(start[0]);
+		close(start[1]);
+
+		int winners = 0;
+		pid_t winner = 0;
+		for (size_t i = 0; i < children.size(); ++i)
+		{
+			if (WaitExitCode(children[i]) == 0)
+			{
+				++winners;
+				winner = children[i];
+			}
+		}
+
+		if (winners > 1)
+			++contested;
+		else if (winners == 0)
+			++unclaimed;
+		else if (region->ownerId.load() != static_cast<uint32_t>(winner))
+			++mismatched;
+	}
+
+	printf("      %d rounds: %d with several owners, %d with none\n", rounds, contested, unclaimed);
+	Check(contested == 0, "only one contender takes over a stale or released region");
+	Check(unclaimed == 0 && mismatched == 0, "the contender told it won is the owner");
+
+	BrokerClose(region);
+}
+
+static void HandoverOnRelease()
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+
+	uint32_t owner = BrokerProcessId();
+	Check(BrokerTryAcquire(region, owner, BrokerNow(), STRESS_OWNER_TIMEOUT), "first instance becomes owner");
+
+	StressState state;
+	StressCaps caps;
+	Fill(7, &state, &caps);
+	for (size_t i = 0; i < BROKER_SLOT_COUNT; ++i)
+		BrokerPublish(region, i, true, state, caps);
+
+	// The contender polls much faster than the owner timeout, so a release is picked up right away
+	int ready[2];
+	if (pipe(ready) != 0)
+	{
+		Check(false, "pipe");
+		return;
+	}
+
+	pid_t contender = fork();
+	if (contender == 0)
+	{
+		close(ready[0]);
+		BrokerRegion* other = BrokerOpen(STRESS_REGION_NAME);
+		uint32_t id = BrokerProcessId();
+
+		if (!other || BrokerTryAcquire(other, id, BrokerNow(), STRESS_OWNER_TIMEOUT))
+			_exit(1);
+
+		// A reader releasing must not touch the owner's slots
+		BrokerRelease(other, id);
+		StressState readState;
+		StressCaps readCaps;
+		bool intact = BrokerRead(other, 3, &readState, &readCaps) && readState.words[0] == 7 && other->ownerId.load() != id;
+
+		if (write(ready[1], &intact, 1) != 1)
+			_exit(3);
+
+		uint64_t start = BrokerNow();
+		while (!BrokerTryAcquire(other, id, BrokerNow(), STRESS_OWNER_TIMEOUT))
+			SleepMs(1);
+
+		// Well below the timeout means it was the release, not a stale heartbeat
+		_exit(BrokerNow() - start < STRESS_OWNER_TIMEOUT / 2 ? 0 : 2);
+	}
+
+	close(ready[1]);
+	bool intact = false;
+	if (read(ready[0], &intact, 1) != 1)
+		intact = false;
+	close(ready[0]);
+
+	Check(intact, "reader release leaves the owner's slots and ownership alone");
+
+	BrokerHeartbeat(region, BrokerNow());
+	BrokerRelease(region, owner);
+
+	StressState readState;
+	StressCaps readCaps;
+	Check(!BrokerRead(region, 3, &readState, &readCaps), "owner release clears the slots");
+	Check(WaitExitCode(contender) == 0, "released region taken over right away");
+
+	BrokerClose(region);
+}
+
+static void VibrationForwarding()
+{
+	BrokerUnlink(STRESS_REGION_NAME);
+	BrokerRegion* region = BrokerOpen(STRESS_REGION_NAME);
+
+	uint16_t left = 0, right = 0;
+	Check(!BrokerTakeVibration(region, 2, &left, &right), "nothing pending in a fresh region");
+
+	pid_t reader = fork();
+	if (reader == 0)
+	{
+		BrokerRegion* other = BrokerOpen(STRESS_REGION_NAME);
+		if (!other)
+			_exit(1);
+
+		BrokerSubmitVibration(other, 2, 1000, 2000);
+		BrokerSubmitVibration(other, 2, 65535, 123);
+		_exit(0);
+	}
+	WaitExitCode(reader);
+
+	Check(BrokerTakeVibration(region, 2, &left, &right) && left == 65535 && right == 123, "owner takes the reader's latest command");
+	Check(!BrokerTakeVibration(region, 2, &left, &right), "a command is taken once");
+	Check(!BrokerTakeVibration(region, 3, &left, &right), "other slots stay quiet");
+
+	BrokerClose(region);
+}
+
+#pragma endregion
+
+int main(int argc, char** argv)
+{
+	int readers = std::max(1, ParseOption(argc, argv, "readers", 4));
+	int seconds = std::max(1, ParseOption(argc, argv, "seconds", 5));
+	int openers = std::max(2, ParseOption(argc, argv, "openers", 16));
+	int contenders = std::max(2, ParseOption(argc, argv, "contenders", 4));
+	int rounds = std::max(1, ParseOption(argc, argv, "rounds", 500));
+
+	// Children print too, don't let them inherit buffered output
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	OpenRace(openers);
+	SeqlockAcrossProcesses(readers, seconds);
+	TakeoverAfterCrash();
+	TakeoverRace(contenders, rounds);
+	HandoverOnRelease();
+	VibrationForwarding();
+
+	BrokerUnlink(STRESS_REGION_NAME);
+
+	return ReportFailures();
+}
@@ -0,0 +1,112 @@
+/*
+	Device slots test.
+
+	Replays, deterministically, the one interleaving that let a borrowed device be released (DeviceSlots.h):
+	a reader picks its reader count and is preempted before incrementing it, a writer removes the
+	device (flipping the counts) and the next one adds another without flipping. The reader then
+	borrows the new device, and removing that device must wait until the borrow ends.
+
+	The writers run from DEVICESLOTS_BORROW_HOOK, i.e. exactly inside the reader's window.
+	Neither of them has to wait for anyone, so the test can't hang there.
+
+	Built on Linux by CMakeLists.txt in this folder, deviceslots-test-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target deviceslots-test
+
+	Usage:
+		deviceslots-test
+
+	Exits with 1 if a check failed.
+*/
+
+static void BorrowHook();
+
+#define DEVICESLOTS_BORROW_HOOK()		BorrowHook()
+
+#include "DeviceSlots.h"
+#include "TestUtil.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#define TEST_SLOT_COUNT					2
+#define TEST_SLOT						1
+#define TEST_WAIT						100			// Milliseconds a blocked removal is given to return early
+
+struct TestWheel
+{
+	int id;
+};
+
+static DeviceSlots<TestWheel, TEST_SLOT_COUNT> gSlots;
+static TestWheel gFirst = { 1 };
+static TestWheel gSecond = { 2 };
+
+static bool gInterleave = false;
+static int gHookCalls = 0;
+
+// Removes the first wheel and adds the second one while the reader is between picking and incrementing its count
+static void BorrowHook()
+{
+	++gHookCalls;
+	if (!gInterleave)
+		return;
+	gInterleave = false;
+
+	DeviceSlotsExchange(gSlots, TEST_SLOT, static_cast<TestWheel*>(NULL));
+	DeviceSlotsExchange(gSlots, TEST_SLOT, &gSecond);
+}
+
+static void RemoveWaitsForStaleReader()
+{
+	DeviceSlotsExchange(gSlots, TEST_SLOT, &gFirst);
+
+	gInterleave = true;
+	DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT>* borrow = new DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT>(gSlots, TEST_SLOT);
+
+	printf("      %d passes through the borrow's window\n", gHookCalls);
+	Check(borrow->Get() == &gSecond, "the borrow holds the wheel added during its window");
+
+	uint32_t epoch = gSlots.epochs[TEST_SLOT].load();
+	Check(gSlots.readers[TEST_SLOT][epoch & 1].load() == 1, "the borrow is on the count the next removal waits for");
+
+	// Remove the second wheel while it is borrowed
+	std::atomic<bool> removed(false);
+	TestWheel* previous = NULL;
+	std::thread remover([&removed, &previous]()
+	{
+		previous = DeviceSlotsExchange(gSlots, TEST_SLOT, static_cast<TestWheel*>(NULL));
+		removed.store(true);
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(TEST_WAIT));
+	Check(!removed.load(), "removing a borrowed wheel waits for the borrow");
+
+	delete borrow;
+	remover.join();
+	Check(removed.load() && previous == &gSecond, "the removal returns the wheel once the borrow ends");
+}
+
+static void NewReadersDontWait()
+{
+	// Without the interleaving a borrow takes a single pass and empty slots read as empty
+	gHookCalls = 0;
+	{
+		DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT> borrow(gSlots, TEST_SLOT);
+		Check(borrow.Get() == NULL && gHookCalls == 1, "an undisturbed borrow takes one pass");
+	}
+	{
+		DeviceSlotBorrow<TestWheel, TEST_SLOT_COUNT> borrow(gSlots, TEST_SLOT_COUNT);
+		Check(borrow.Get() == NULL, "out-of-range slots are empty");
+	}
+	Check(gSlots.readers[TEST_SLOT][0].load() == 0 && gSlots.readers[TEST_SLOT][1].load() == 0, "every count drained");
+}
+
+int main()
+{
+	RemoveWaitsForStaleReader();
+	NewReadersDontWait();
+
+	return ReportFailures();
+}
@@ -0,0 +1,357 @@
+/*
+	Haptics synthesizer tests and timing-jitter benchmark.
+
+	Drives the synthesizer (Haptics.h) with a fake sink that records every frame:
+	- the tables follow the settings (lengths, swaps, strengths, pulse train),
+	- envelopes rise along the attack curve and fall along the decay curve, landing exactly on the target,
+	- an idle slot never reaches the sink and a slot that faded out stops talking to it,
+	- slots don't leak into each other and out-of-range slots are ignored,
+	- a slot reset after its wheel is removed goes quiet, and the next wheel gets its first command
+	  even when it repeats the old one.
+
+	Then runs the real timer thread at a few update rates and reports how far each tick
+	landed from its deadline (p50/p99/max). The benchmark only reports, it doesn't fail the run.
+
+	Built on Linux by CMakeLists.txt in this folder, haptics-test-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target haptics-test
+
+	Usage:
+		haptics-test [--seconds=2]
+
+	--seconds is the benchmark length per update rate, 0 skips the benchmark. Exits with 1 if a check failed.
+*/
+
+#include "Haptics.h"
+#include "TestUtil.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct RecordedFrame
+{
+	size_t slot;
+	HapticsFrame frame;
+};
+
+static std::vector<RecordedFrame> gFrames;
+static bool Near(float a, float b)
+{
+	return fabsf(a - b) < 1e-5f;
+}
+
+static void RecordingSink(void*, size_t slot, const HapticsFrame& frame)
+{
+	RecordedFrame recorded;
+	recorded.slot = slot;
+	recorded.frame = frame;
+	gFrames.push_back(recorded);
+}
+
+static HapticsSettings DefaultSettings()
+{
+	HapticsSettings settings;
+	settings.LTriggerStrength = 0.25f;
+	settings.RTriggerStrength = 0.5f;
+	settings.LMotorStrength = 1.0f;
+	settings.RMotorStrength = 0.75f;
+	settings.TriggerSwap = false;
+	settings.MotorSwap = false;
+	settings.UpdateRate = 500;
+	settings.AttackTime = 10;
+	settings.DecayTime = 60;
+	settings.TriggerPulseRate = 30;
+	return settings;
+}
+
+// Ticks by hand, no timer thread
+static void Setup(HapticsEngine* engine, const HapticsSettings& settings)
+{
+	HapticsBuildTables(settings, &engine->tables);
+	HapticsReset(engine);
+	engine->sink = RecordingSink;
+	engine->context = NULL;
+	gFrames.clear();
+}
+
+static void Tick(HapticsEngine* engine, int ticks)
+{
+	for (int i = 0; i < ticks; ++i)
+		HapticsTick(engine);
+}
+
+#pragma region Tests
+
+static void TestTables(HapticsEngine* engine)
+{
+	HapticsSettings settings = DefaultSettings();
+	Setup(engine, settings);
+
+	// 10ms and 60ms at 500Hz
+	Check(engine->tables.attackLength == 5 && engine->tables.decayLength == 30, "envelope lengths follow AttackTime/DecayTime");
+	Check(engine->tables.attack[engine->tables.attackLength - 1] == 1.f && engine->tables.decay[engine->tables.decayLength - 1] == 1.f, "curves end on 1");
+	Check(engine->tables.pulseIncrement != 0, "pulse train enabled");
+
+	settings.AttackTime = 100000;
+	settings.TriggerPulseRate = 0;
+	Setup(engine, settings);
+	Check(engine->tables.attackLength == HAPTICS_MAX_ENVELOPE, "envelope length is capped");
+	Check(engine->tables.pulseIncrement == 0 && engine->tables.pulse[0] == 1.f, "pulse rate 0 gives a steady trigger");
+}
+
+static void TestEnvelopes(HapticsEngine* engine)
+{
+	HapticsSettings settings = DefaultSettings();
+	settings.TriggerPulseRate = 0;
+	Setup(engine, settings);
+
+	HapticsSubmit(engine, 1, 65535, 0);
+	Tick(engine, engine->tables.attackLength);
+
+	bool rising = gFrames.size() == static_cast<size_t>(engine->tables.attackLength);
+	for (size_t i = 1; i < gFrames.size(); ++i)
+		rising = rising && gFrames[i].frame.LeftMotor > gFrames[i - 1].frame.LeftMotor;
+	Check(rising, "attack rises on every tick");
+
+	const HapticsFrame& top = gFrames.back().frame;
+	Check(Near(top.LeftMotor, 1.f) && top.RightMotor == 0 && Near(top.LeftTrigger, 0.25f) && top.RightTrigger == 0,
+		"attack lands on the target, scaled by the strengths");
+
+	gFrames.clear();
+	HapticsSubmit(engine, 1, 0, 0);
+	Tick(engine, engine->tables.decayLength);
+
+	bool falling = gFrames.size() == static_cast<size_t>(engine->tables.decayLength);
+	for (size_t i = 1; i < gFrames.size(); ++i)
+		falling = falling && gFrames[i].frame.LeftMotor < gFrames[i - 1].frame.LeftMotor;
+	Check(falling, "decay falls on every tick");
+	Check(gFrames.back().frame.LeftMotor == 0 && gFrames.back().frame.LeftTrigger == 0, "decay lands on silence");
+
+	// Halfway through an attack a weaker command turns into a decay from where the envelope is
+	gFrames.clear();
+	HapticsSubmit(engine, 1, 65535, 0);
+	Tick(engine, 2);
+	float halfway = gFrames.back().frame.LeftMotor;
+	HapticsSubmit(engine, 1, 0, 0);
+	Tick(engine, 1);
+	Check(gFrames.back().frame.LeftMotor < halfway && gFrames.back().frame.LeftMotor > 0, "retargeting continues from the current value");
+}
+
+static void TestSilence(HapticsEngine* engine)
+{
+	Setup(engine, DefaultSettings());
+
+	Tick(engine, 100);
+	Check(gFrames.empty(), "idle slots never reach the sink");
+
+	HapticsSubmit(engine, 0, 30000, 30000);
+	Tick(engine, 50);
+	HapticsSubmit(engine, 0, 0, 0);
+	Tick(engine, engine->tables.decayLength + 1);
+
+	size_t frames = gFrames.size();
+	Check(gFrames.back().frame.LeftMotor == 0 && gFrames.back().frame.RightTrigger == 0, "last frame is silent");
+
+	Tick(engine, 100);
+	Check(gFrames.size() == frames, "a faded-out slot stops talking to the sink");
+
+	// The same command twice doesn't restart the envelope
+	HapticsSubmit(engine, 0, 65535, 65535);
+	Tick(engine, 50);
+	gFrames.clear();
+	HapticsSubmit(engine, 0, 65535, 65535);
+	Tick(engine, 1);
+	Check(gFrames.empty() || Near(gFrames.back().frame.LeftMotor, 1.f), "repeated command keeps the envelope where it is");
+}
+
+static void TestSwap(HapticsEngine* engine)
+{
+	HapticsSettings settings = DefaultSettings();
+	settings.TriggerPulseRate = 0;
+	settings.MotorSwap = true;
+	Setup(engine, settings);
+
+	HapticsSubmit(engine, 0, 65535, 0);
+	Tick(engine, 20);
+	const HapticsFrame& motors = gFrames.back().frame;
+	Check(motors.LeftMotor == 0 && Near(motors.RightMotor, 0.75f), "MotorSwap moves the left speed to the right motor");
+	Check(Near(motors.LeftTrigger, 0.25f) && motors.RightTrigger == 0, "MotorSwap leaves the triggers alone");
+
+	settings.MotorSwap = false;
+	settings.TriggerSwap = true;
+	Setup(engine, settings);
+
+	HapticsSubmit(engine, 0, 0, 65535);
+	Tick(engine, 20);
+	const HapticsFrame& triggers = gFrames.back().frame;
+	Check(Near(triggers.LeftTrigger, 0.25f) && triggers.RightTrigger == 0, "TriggerSwap moves the right speed to the left trigger");
+	Check(triggers.LeftMotor == 0 && Near(triggers.RightMotor, 0.75f), "TriggerSwap leaves the motors alone");
+}
+
+static void TestPulse(HapticsEngine* engine)
+{
+	Setup(engine, DefaultSettings());
+
+	HapticsSubmit(engine, 0, 65535, 65535);
+	Tick(engine, 200);
+
+	float lowest = 1.f, highest = 0.f;
+	bool steadyMotors = true;
+	for (size_t i = gFrames.size() / 2; i < gFrames.size(); ++i)
+	{
+		lowest = std::min(lowest, gFrames[i].frame.RightTrigger);
+		highest = std::max(highest, gFrames[i].frame.RightTrigger);
+		steadyMotors = steadyMotors && Near(gFrames[i].frame.RightMotor, 0.75f);
+	}
+
+	Check(highest > lowest * 1.5f && highest <= 0.5f + 1e-5f, "triggers pulse below their strength");
+	Check(steadyMotors, "motors don't pulse");
+}
+
+static void TestSlots(HapticsEngine* engine)
+{
+	Setup(engine, DefaultSettings());
+
+	HapticsSubmit(engine, 3, 65535, 65535);
+	HapticsSubmit(engine, HAPTICS_SLOT_COUNT, 65535, 65535);
+	Tick(engine, 20);
+
+	bool onlyThree = !gFrames.empty();
+	for (size_t i = 0; i < gFrames.size(); ++i)
+		onlyThree = onlyThree && gFrames[i].slot == 3;
+	Check(onlyThree, "commands only reach their own slot, out-of-range slots are ignored");
+}
+
+static void TestSlotReset(HapticsEngine* engine)
+{
+	// With pulses the frames keep changing, so a leftover command would keep driving the sink
+	Setup(engine, DefaultSettings());
+
+	HapticsSubmit(engine, 2, 65535, 65535);
+	Tick(engine, 50);
+	HapticsResetSlot(engine, 2);
+	gFrames.clear();
+	Tick(engine, 100);
+	Check(gFrames.empty(), "a reset slot stops at once instead of playing the removed wheel's command");
+
+	HapticsSubmit(engine, 2, 30000, 0);
+	Tick(engine, 1);
+	Check(!gFrames.empty() && gFrames[0].frame.LeftMotor > 0 && gFrames[0].frame.LeftMotor < 0.5f, "the next command ramps up from silence");
+
+	// Without pulses an unchanged command produces unchanged frames that are never resent
+	HapticsSettings settings = DefaultSettings();
+	settings.TriggerPulseRate = 0;
+	Setup(engine, settings);
+
+	HapticsSubmit(engine, 2, 65535, 65535);
+	Tick(engine, 50);
+	HapticsResetSlot(engine, 2);
+	Tick(engine, 1);
+	gFrames.clear();
+	HapticsSubmit(engine, 2, 65535, 65535);
+	Tick(engine, 50);
+	Check(!gFrames.empty() && Near(gFrames.back().frame.LeftMotor, 1.f), "the next wheel gets the same command again");
+
+	// A command submitted between the reset and the next tick belongs to the next wheel
+	HapticsResetSlot(engine, 2);
+	HapticsSubmit(engine, 2, 65535, 0);
+	gFrames.clear();
+	Tick(engine, 50);
+	Check(!gFrames.empty() && Near(gFrames.back().frame.LeftMotor, 1.f) && gFrames.back().frame.RightMotor == 0, "a command right after the reset is kept");
+
+	HapticsResetSlot(engine, HAPTICS_SLOT_COUNT);
+}
+
+#pragma endregion
+
+#pragma region Jitter
+
+static std::vector<uint64_t> gTickTimes;
+
+static uint64_t NowNanoseconds()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The sink only hears about frames that changed, so it flips the command every time to see every tick
+static void TimingSink(void* context, size_t slot, const HapticsFrame&)
+{
+	if (slot != 0 || gTickTimes.size() >= gTickTimes.capacity())
+		return;
+
+	gTickTimes.push_back(NowNanoseconds());
+
+	uint16_t speed = (gTickTimes.size() & 1) ? 0 : 65535;
+	HapticsSubmit(static_cast<HapticsEngine*>(context), 0, speed, speed);
+}
+
+// Jitter is the distance to the nearest whole number of periods, a tick overrunning into the next one shows up once
+static void BenchmarkJitter(HapticsEngine* engine, int updateRate, int seconds)
+{
+	HapticsSettings settings = DefaultSettings();
+	settings.UpdateRate = updateRate;
+	settings.TriggerPulseRate = 0;
+	HapticsBuildTables(settings, &engine->tables);
+	HapticsReset(engine);
+
+	gTickTimes.clear();
+	gTickTimes.reserve(static_cast<size_t>(updateRate) * seconds + 16);
+
+	HapticsSubmit(engine, 0, 65535, 65535);
+	HapticsStart(engine, updateRate, TimingSink, engine);
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	HapticsStop(engine);
+
+	if (gTickTimes.size() < 2)
+	{
+		printf("      %4dHz: no ticks\n", updateRate);
+		return;
+	}
+
+	const double period = 1e9 / updateRate;
+	std::vector<double> jitter;
+	for (size_t i = 1; i < gTickTimes.size(); ++i)
+	{
+		double interval = static_cast<double>(gTickTimes[i] - gTickTimes[i - 1]);
+		double periods = std::max(1.0, std::floor(interval / period + 0.5));
+		jitter.push_back(fabs(interval - periods * period) / 1000.0);
+	}
+	std::sort(jitter.begin(), jitter.end());
+
+	printf("      %4dHz: %6zu ticks, jitter p50 %7.1fus  p99 %7.1fus  max %8.1fus\n", updateRate, gTickTimes.size(),
+		jitter[jitter.size() / 2], jitter[jitter.size() * 99 / 100], jitter.back());
+}
+
+#pragma endregion
+
+int main(int argc, char** argv)
+{
+	int seconds = std::max(0, ParseOption(argc, argv, "seconds", 2));
+
+	// Holds the tables and a std::thread, too big for the stack of some platforms
+	static HapticsEngine engine;
+
+	TestTables(&engine);
+	TestEnvelopes(&engine);
+	TestSilence(&engine);
+	TestSwap(&engine);
+	TestPulse(&engine);
+	TestSlots(&engine);
+	TestSlotReset(&engine);
+
+	if (seconds > 0)
+	{
+		printf("\ntimer jitter:\n");
+		BenchmarkJitter(&engine, 250, seconds);
+		BenchmarkJitter(&engine, 500, seconds);
+		BenchmarkJitter(&engine, 1000, seconds);
+	}
+
+	return ReportFailures();
+}
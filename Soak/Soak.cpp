@@ -0,0 +1,849 @@
+/*
+	Concurrency soak harness.
+
+	Runs the export paths of the DLL against a simulated device backend: several caller threads
+	poll XInputGetState/XInputGetStateEx/XInputSetState/XInputGetCapabilities at a fixed rate
+	while hotplug threads connect and disconnect devices at random, the way RacingWheelAdded and
+	RacingWheelRemoved rescan on a WinRT callback thread. The slot handling (DeviceSlots.h),
+	the broker (Broker.h) and the haptics synthesizer (Haptics.h) are the same code the DLL uses.
+
+	The rest mirrors dllmain.cpp:
+	- the vibration sink caches a gamepad view per slot and refreshes it when the scan generation changes,
+	- a broker thread publishes every slot with capabilities cached per scan generation and plays
+	  the vibration the readers leave in the region,
+	- some caller threads act like the exports of a broker reader process.
+
+	Reports p50/p99/p99.9/max latency per export and checks that
+	- no call returns a state from a device whose removal had already completed when the call started,
+	- no call, publish or haptics frame touches a device or gamepad after it was released,
+	- the sink never uses a gamepad cached from before a scan that it has already seen,
+	- readers never get a state published with another device's capabilities,
+	- every reader count drains back to zero and every device and gamepad is released exactly once.
+
+	Built on Linux by CMakeLists.txt in this folder, soak-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target soak
+
+	Usage:
+		soak [--threads=4] [--reader-threads=2] [--rate=1000] [--seconds=10] [--hotplug-threads=2] [--hotplug-rate=200]
+		     [--poll-interval=4] [--reading-yields=0] [--seed=1]
+
+	--rate is per caller thread and per second (0 for as fast as possible), --hotplug-rate is the
+	number of connects/disconnects per second and per hotplug thread, --poll-interval is the broker
+	owner's in milliseconds (0 for as fast as possible). --reading-yields=1 yields in every reading like
+	a call going out of process would, so scans land inside the publisher's loop even on one core.
+	Exits with 1 if an invariant broke.
+*/
+
+#include "Broker.h"
+#include "DeviceSlots.h"
+#include "Haptics.h"
+#include "TestUtil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MAX_PLAYER_COUNT				8
+#define XUSER_MAX_COUNT					4
+
+#define SOAK_REGION_NAME				"X1nputSoak"
+
+#define ERROR_SUCCESS					0
+#define ERROR_DEVICE_NOT_CONNECTED		1167
+
+typedef uint32_t DWORD;
+
+// Same layout as the DLL's structures
+struct XINPUT_GAMEPAD
+{
+	uint16_t wButtons;
+	uint8_t bLeftTrigger;
+	uint8_t bRightTrigger;
+	int16_t sThumbLX;
+	int16_t sThumbLY;
+	int16_t sThumbRX;
+	int16_t sThumbRY;
+};
+
+struct XINPUT_STATE
+{
+	DWORD dwPacketNumber;
+	XINPUT_GAMEPAD Gamepad;
+};
+
+struct XINPUT_CAPABILITIES
+{
+	uint8_t Type;
+	uint8_t SubType;
+	uint16_t Flags;
+	XINPUT_GAMEPAD Gamepad;
+	uint16_t wLeftMotorSpeed;
+	uint16_t wRightMotorSpeed;
+};
+
+#pragma region Simulated devices
+
+std::atomic<uint64_t> gViolations(0);
+
+static void Violation(const char* what, uint32_t id)
+{
+	// Only the first few are worth printing, the count tells the rest
+	if (gViolations.fetch_add(1) < 16)
+		fprintf(stderr, "VIOLATION: %s (device %u)\n", what, id);
+}
+
+// Bumped every time a removal completes
+std::atomic<uint64_t> gRemovalSequence(0);
+
+std::atomic<uint64_t> gDevicesCreated(0);
+std::atomic<uint64_t> gDevicesReleased(0);
+std::atomic<uint64_t> gGamepadsCreated(0);
+std::atomic<uint64_t> gGamepadsReleased(0);
+
+// Odd while a scan runs, like gScanGeneration in the DLL
+std::atomic<uint32_t> gScanGeneration(0);
+
+// Stands in for the IGamepad view of a wheel, reference counted like the COM object.
+// Released gamepads are kept until exit so touching one is a violation, not a crash.
+struct SimGamepad
+{
+	uint32_t id;
+	std::atomic<uint32_t> references;
+	std::atomic<bool> alive;
+	std::atomic<uint32_t> removedGeneration;	// Scan generation that has its wheel removed, 0 while connected
+
+	explicit SimGamepad(uint32_t wheelId)
+		: id(wheelId), references(1), alive(true), removedGeneration(0)
+	{
+		gGamepadsCreated.fetch_add(1);
+	}
+
+	void AddRef()
+	{
+		if (!alive.load(std::memory_order_acquire))
+			Violation("reference taken on a released gamepad", id);
+		references.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void Release();
+
+	// Like put_Vibration
+	void PutVibration(uint32_t generation)
+	{
+		if (!alive.load(std::memory_order_acquire))
+			Violation("haptics frame sent to a released gamepad", id);
+
+		uint32_t removed = removedGeneration.load(std::memory_order_acquire);
+		if (removed != 0 && static_cast<int32_t>(generation - removed) >= 0)
+			Violation("haptics frame sent to a gamepad removed by a scan the sink had seen", id);
+	}
+};
+
+std::mutex gGamepadGraveyardLock;
+std::vector<SimGamepad*> gGamepadGraveyard;
+
+void SimGamepad::Release()
+{
+	if (references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	alive.store(false, std::memory_order_release);
+	gGamepadsReleased.fetch_add(1);
+
+	std::lock_guard<std::mutex> lock(gGamepadGraveyardLock);
+	gGamepadGraveyard.push_back(this);
+}
+
+bool gReadingYields = false;
+
+// Stands in for IRacingWheel. The slot owns it, it is deleted once removed.
+struct SimWheel
+{
+	uint32_t id;
+	std::atomic<bool> alive;
+	std::atomic<uint64_t> removedAt;	// gRemovalSequence after the removal completed, 0 while connected
+	std::atomic<uint32_t> readings;
+	SimGamepad* gamepad;
+
+	explicit SimWheel(uint32_t wheelId)
+		: id(wheelId), alive(true), removedAt(0), readings(0), gamepad(new SimGamepad(wheelId))
+	{
+		gDevicesCreated.fetch_add(1);
+	}
+
+	~SimWheel()
+	{
+		gamepad->Release();
+		gDevicesReleased.fetch_add(1);
+	}
+
+	void CheckAlive(const char* what)
+	{
+		if (!alive.load(std::memory_order_acquire))
+			Violation(what, id);
+	}
+
+	// Like GetCurrentReading: touches the device, so using a released one is caught (and by TSan/ASan)
+	bool GetCurrentReading(XINPUT_STATE* state)
+	{
+		CheckAlive("reading from a released device");
+
+		// get_CurrentReading goes out of process, give the other threads a chance to run meanwhile
+		if (gReadingYields)
+			std::this_thread::yield();
+
+		uint32_t reading = readings.fetch_add(1, std::memory_order_relaxed);
+
+		memset(state, 0, sizeof(*state));
+		state->dwPacketNumber = id;
+		state->Gamepad.sThumbLX = static_cast<int16_t>(reading);
+		return true;
+	}
+
+	// The id goes into the motor speeds, so a reader can tell whose capabilities were published
+	bool GetCapabilities(XINPUT_CAPABILITIES* capabilities)
+	{
+		CheckAlive("capabilities of a released device");
+
+		memset(capabilities, 0, sizeof(*capabilities));
+		capabilities->Type = 1;
+		capabilities->SubType = 2;
+		capabilities->wLeftMotorSpeed = static_cast<uint16_t>(id & 0xFFFF);
+		capabilities->wRightMotorSpeed = static_cast<uint16_t>(id >> 16);
+		return true;
+	}
+
+	// Like IGamepadStatics2::FromGameController
+	SimGamepad* FromGameController()
+	{
+		CheckAlive("gamepad view of a released device");
+
+		gamepad->AddRef();
+		return gamepad;
+	}
+};
+
+static uint32_t CapabilitiesId(const XINPUT_CAPABILITIES& capabilities)
+{
+	return capabilities.wLeftMotorSpeed | (static_cast<uint32_t>(capabilities.wRightMotorSpeed) << 16);
+}
+
+HapticsEngine gHaptics;
+
+DeviceSlots<SimWheel, MAX_PLAYER_COUNT> racingWheels;
+typedef DeviceSlotBorrow<SimWheel, MAX_PLAYER_COUNT> RacingWheelBorrow;
+
+// Serializes the hotplug threads, like gScanLock in the DLL
+std::mutex gScanLock;
+std::atomic<uint32_t> gNextWheelId(1);
+
+// The scans below hold gScanLock and bump the generation when they start and end, like ScanRacingWheels
+static void AddWheel(size_t slot)
+{
+	DeviceSlotsExchange(racingWheels, slot, new SimWheel(gNextWheelId.fetch_add(1)));
+}
+
+static void RemoveWheel(size_t slot)
+{
+	SimWheel* removed = DeviceSlotsExchange(racingWheels, slot, static_cast<SimWheel*>(NULL));
+
+	// No call can see the wheel anymore, everything starting from here must not return it
+	removed->removedAt.store(gRemovalSequence.fetch_add(1) + 1, std::memory_order_release);
+	removed->alive.store(false, std::memory_order_release);
+	HapticsResetSlot(&gHaptics, slot);
+
+	// Scans are serialized, so this is the generation the current one ends with
+	removed->gamepad->removedGeneration.store(gScanGeneration.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	delete removed;
+}
+
+// Finds a slot that is empty (or not), starting at a random one
+static size_t FindSlot(std::mt19937& random, bool connected)
+{
+	size_t start = random() % MAX_PLAYER_COUNT;
+	for (size_t i = 0; i < MAX_PLAYER_COUNT; ++i)
+	{
+		size_t slot = (start + i) % MAX_PLAYER_COUNT;
+		if ((DeviceSlotsPeek(racingWheels, slot) != NULL) == connected)
+			return slot;
+	}
+	return MAX_PLAYER_COUNT;
+}
+
+static bool Connect(std::mt19937& random)
+{
+	std::lock_guard<std::mutex> lock(gScanLock);
+	gScanGeneration.fetch_add(1, std::memory_order_seq_cst);
+
+	size_t slot = FindSlot(random, false);
+	if (slot == MAX_PLAYER_COUNT)
+		return false;
+
+	AddWheel(slot);
+	gScanGeneration.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+static bool Disconnect(std::mt19937& random)
+{
+	std::lock_guard<std::mutex> lock(gScanLock);
+	gScanGeneration.fetch_add(1, std::memory_order_seq_cst);
+
+	size_t slot = FindSlot(random, true);
+	if (slot == MAX_PLAYER_COUNT)
+		return false;
+
+	RemoveWheel(slot);
+	gScanGeneration.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+// One wheel unplugged and another one plugged in before the scan ran: it lands in the freed slot
+static bool Replace(std::mt19937& random)
+{
+	std::lock_guard<std::mutex> lock(gScanLock);
+	gScanGeneration.fetch_add(1, std::memory_order_seq_cst);
+
+	size_t slot = FindSlot(random, true);
+	if (slot == MAX_PLAYER_COUNT)
+		return false;
+
+	RemoveWheel(slot);
+	AddWheel(slot);
+	gScanGeneration.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+static void DisconnectAll()
+{
+	std::lock_guard<std::mutex> lock(gScanLock);
+
+	for (size_t slot = 0; slot < MAX_PLAYER_COUNT; ++slot)
+	{
+		SimWheel* removed = DeviceSlotsExchange(racingWheels, slot, static_cast<SimWheel*>(NULL));
+		if (removed)
+		{
+			removed->alive.store(false, std::memory_order_release);
+			delete removed;
+		}
+	}
+}
+
+#pragma endregion
+
+#pragma region Broker
+
+BrokerRegion* gBroker = NULL;
+
+// Caller threads standing in for a reader process
+static thread_local bool t_BrokerReader = false;
+
+static bool IsBrokerReader()
+{
+	return t_BrokerReader;
+}
+
+DWORD BrokerGetState(DWORD dwUserIndex, XINPUT_STATE *pState)
+{
+	XINPUT_CAPABILITIES capabilities;
+	if (dwUserIndex >= BROKER_SLOT_COUNT || !BrokerRead(gBroker, dwUserIndex, pState, &capabilities))
+		return ERROR_DEVICE_NOT_CONNECTED;
+
+	if (pState->dwPacketNumber != CapabilitiesId(capabilities))
+		Violation("state published with another device's capabilities", pState->dwPacketNumber);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD BrokerGetConnected(DWORD dwUserIndex)
+{
+	XINPUT_STATE state;
+	return BrokerGetState(dwUserIndex, &state);
+}
+
+DWORD BrokerGetCapabilities(DWORD dwUserIndex, XINPUT_CAPABILITIES *pCapabilities)
+{
+	XINPUT_STATE state;
+	if (dwUserIndex >= BROKER_SLOT_COUNT || !BrokerRead(gBroker, dwUserIndex, &state, pCapabilities))
+		return ERROR_DEVICE_NOT_CONNECTED;
+
+	return ERROR_SUCCESS;
+}
+
+// Owner side, only the broker thread touches these
+XINPUT_CAPABILITIES gPublishedCapabilities[MAX_PLAYER_COUNT];
+bool gPublishedCapabilitiesValid[MAX_PLAYER_COUNT];
+uint32_t gPublishedKeys[MAX_PLAYER_COUNT];
+
+void PublishRacingWheels()
+{
+	for (size_t i = 0; i < MAX_PLAYER_COUNT; ++i)
+	{
+		XINPUT_STATE state = {};
+
+		uint32_t before = gScanGeneration.load(std::memory_order_seq_cst);
+		RacingWheelBorrow racingWheel(racingWheels, i);
+		uint32_t after = gScanGeneration.load(std::memory_order_seq_cst);
+		bool settled = before == after && !(before & 1);
+
+		if (!settled || gPublishedKeys[i] != before + 1)
+		{
+			gPublishedKeys[i] = settled ? before + 1 : 0;
+			gPublishedCapabilities[i] = XINPUT_CAPABILITIES();
+			gPublishedCapabilitiesValid[i] = racingWheel.Get() && racingWheel->GetCapabilities(&gPublishedCapabilities[i]);
+		}
+
+		bool connected = racingWheel.Get() && gPublishedCapabilitiesValid[i] && racingWheel->GetCurrentReading(&state);
+
+		BrokerPublish(gBroker, i, connected, state, gPublishedCapabilities[i]);
+	}
+}
+
+void ForwardBrokerVibration()
+{
+	for (size_t i = 0; i < MAX_PLAYER_COUNT; ++i)
+	{
+		uint16_t leftSpeed, rightSpeed;
+		if (BrokerTakeVibration(gBroker, i, &leftSpeed, &rightSpeed))
+			HapticsSubmit(&gHaptics, i, leftSpeed, rightSpeed);
+	}
+}
+
+#pragma endregion
+
+#pragma region Exports
+
+static void CheckNotRemoved(const SimWheel* wheel, uint64_t callStart)
+{
+	uint64_t removedAt = wheel->removedAt.load(std::memory_order_acquire);
+	if (removedAt != 0 && removedAt <= callStart)
+		Violation("state returned from a device removed before the call", wheel->id);
+}
+
+DWORD XInputGetState(DWORD dwUserIndex, XINPUT_STATE *pState)
+{
+	if (IsBrokerReader()) {
+		return BrokerGetState(dwUserIndex, pState);
+	}
+
+	uint64_t callStart = gRemovalSequence.load();
+
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	if (!racingWheel->GetCurrentReading(pState)) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	CheckNotRemoved(racingWheel.Get(), callStart);
+	return ERROR_SUCCESS;
+}
+
+DWORD XInputGetStateEx(DWORD dwUserIndex, XINPUT_STATE *pState)
+{
+	return XInputGetState(dwUserIndex, pState);
+}
+
+DWORD XInputSetState(DWORD dwUserIndex, uint16_t wLeftMotorSpeed, uint16_t wRightMotorSpeed)
+{
+	if (IsBrokerReader()) {
+		DWORD result = BrokerGetConnected(dwUserIndex);
+		if (result == ERROR_SUCCESS)
+			BrokerSubmitVibration(gBroker, dwUserIndex, wLeftMotorSpeed, wRightMotorSpeed);
+		return result;
+	}
+
+	uint64_t callStart = gRemovalSequence.load();
+
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	XINPUT_STATE state;
+	if (!racingWheel->GetCurrentReading(&state)) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	CheckNotRemoved(racingWheel.Get(), callStart);
+	HapticsSubmit(&gHaptics, dwUserIndex, wLeftMotorSpeed, wRightMotorSpeed);
+	return ERROR_SUCCESS;
+}
+
+DWORD XInputGetCapabilities(DWORD dwUserIndex, XINPUT_CAPABILITIES *pCapabilities)
+{
+	if (IsBrokerReader()) {
+		return BrokerGetCapabilities(dwUserIndex, pCapabilities);
+	}
+
+	uint64_t callStart = gRemovalSequence.load();
+
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	XINPUT_STATE state;
+	if (!racingWheel->GetCurrentReading(&state) || !racingWheel->GetCapabilities(pCapabilities)) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	CheckNotRemoved(racingWheel.Get(), callStart);
+	return ERROR_SUCCESS;
+}
+
+// Only the haptics timer thread touches these
+SimGamepad* gHapticsGamepads[MAX_PLAYER_COUNT];
+uint32_t gHapticsGenerations[MAX_PLAYER_COUNT];
+
+// Runs on the haptics timer thread, like RacingWheelVibrationSink
+static void SimVibrationSink(void*, size_t slot, const HapticsFrame&)
+{
+	uint32_t generation = gScanGeneration.load(std::memory_order_acquire);
+	if (generation != gHapticsGenerations[slot])
+	{
+		gHapticsGenerations[slot] = generation;
+		if (gHapticsGamepads[slot])
+			gHapticsGamepads[slot]->Release();
+		gHapticsGamepads[slot] = NULL;
+
+		RacingWheelBorrow racingWheel(racingWheels, slot);
+
+		if (racingWheel.Get())
+			gHapticsGamepads[slot] = racingWheel->FromGameController();
+	}
+
+	SimGamepad* gamepad = gHapticsGamepads[slot];
+	if (!gamepad)
+		return;
+
+	gamepad->PutVibration(generation);
+}
+
+// After the timer thread stopped, like the ComPtrs going away at exit
+static void ReleaseHapticsGamepads()
+{
+	for (size_t slot = 0; slot < MAX_PLAYER_COUNT; ++slot)
+	{
+		if (gHapticsGamepads[slot])
+			gHapticsGamepads[slot]->Release();
+		gHapticsGamepads[slot] = NULL;
+	}
+}
+
+#pragma endregion
+
+#pragma region Latency
+
+// Log-linear histogram: 32 buckets per power of two, about 3% resolution. No allocation while recording.
+#define HISTOGRAM_SUB_BITS				5
+#define HISTOGRAM_BUCKETS				(64 << HISTOGRAM_SUB_BITS)
+
+struct Histogram
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+
+	Histogram() : counts(), total(0), max(0) {}
+
+	static size_t Bucket(uint64_t value)
+	{
+		if (value < (1u << HISTOGRAM_SUB_BITS))
+			return static_cast<size_t>(value);
+
+		int exponent = 63;
+		while (!(value & (1ULL << exponent)))
+			--exponent;
+
+		int shift = exponent - HISTOGRAM_SUB_BITS;
+		size_t sub = static_cast<size_t>((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+		return ((static_cast<size_t>(shift) + 1) << HISTOGRAM_SUB_BITS) + sub;
+	}
+
+	// Upper bound of the bucket
+	static uint64_t Value(size_t bucket)
+	{
+		if (bucket < (1u << HISTOGRAM_SUB_BITS))
+			return bucket;
+
+		int shift = static_cast<int>(bucket >> HISTOGRAM_SUB_BITS) - 1;
+		uint64_t sub = bucket & ((1u << HISTOGRAM_SUB_BITS) - 1);
+		return (((1ULL << HISTOGRAM_SUB_BITS) | sub) << shift) + ((1ULL << shift) - 1);
+	}
+
+	void Record(uint64_t value)
+	{
+		++counts[std::min<size_t>(Bucket(value), HISTOGRAM_BUCKETS - 1)];
+		++total;
+		max = std::max(max, value);
+	}
+
+	void Merge(const Histogram& other)
+	{
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+			counts[i] += other.counts[i];
+		total += other.total;
+		max = std::max(max, other.max);
+	}
+
+	uint64_t Percentile(double percentile) const
+	{
+		uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if (seen > rank)
+				return std::min(Value(i), max);
+		}
+		return max;
+	}
+};
+
+enum SoakExport
+{
+	SOAK_GET_STATE = 0,
+	SOAK_GET_STATE_EX,
+	SOAK_SET_STATE,
+	SOAK_GET_CAPABILITIES,
+	SOAK_EXPORT_COUNT,
+};
+
+static const char* c_ExportNames[SOAK_EXPORT_COUNT] = {
+	"XInputGetState",
+	"XInputGetStateEx",
+	"XInputSetState",
+	"XInputGetCapabilities",
+};
+
+static uint64_t NowNanoseconds()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#pragma endregion
+
+#pragma region Threads
+
+struct SoakOptions
+{
+	int threads;
+	int readerThreads;
+	int rate;
+	int seconds;
+	int hotplugThreads;
+	int hotplugRate;
+	int pollInterval;
+	unsigned seed;
+};
+
+std::atomic<bool> gStop(false);
+
+// One game thread: every "frame" polls all users, rumbles one and now and then asks for capabilities
+static void CallerThread(const SoakOptions& options, unsigned seed, bool brokerReader, Histogram* histograms)
+{
+	t_BrokerReader = brokerReader;
+
+	std::mt19937 random(seed);
+	const std::chrono::nanoseconds period(options.rate > 0 ? 1000000000LL / options.rate : 0);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+	uint32_t frame = 0;
+
+	while (!gStop.load(std::memory_order_relaxed))
+	{
+		XINPUT_STATE state;
+		for (DWORD user = 0; user < XUSER_MAX_COUNT; ++user)
+		{
+			uint64_t start = NowNanoseconds();
+			XInputGetState(user, &state);
+			histograms[SOAK_GET_STATE].Record(NowNanoseconds() - start);
+		}
+
+		DWORD user = random() % MAX_PLAYER_COUNT;
+
+		uint64_t start = NowNanoseconds();
+		XInputGetStateEx(user, &state);
+		histograms[SOAK_GET_STATE_EX].Record(NowNanoseconds() - start);
+
+		start = NowNanoseconds();
+		XInputSetState(user, static_cast<uint16_t>(random()), static_cast<uint16_t>(random()));
+		histograms[SOAK_SET_STATE].Record(NowNanoseconds() - start);
+
+		if (frame++ % 60 == 0)
+		{
+			XINPUT_CAPABILITIES capabilities;
+			start = NowNanoseconds();
+			XInputGetCapabilities(user, &capabilities);
+			histograms[SOAK_GET_CAPABILITIES].Record(NowNanoseconds() - start);
+		}
+
+		if (options.rate > 0)
+		{
+			deadline += period;
+			std::this_thread::sleep_until(deadline);
+		}
+	}
+}
+
+// The broker owner's poll loop, like BrokerThread once it owns the region
+static void BrokerThread(const SoakOptions& options, uint64_t* polls)
+{
+	while (!gStop.load(std::memory_order_relaxed))
+	{
+		PublishRacingWheels();
+		ForwardBrokerVibration();
+		++*polls;
+
+		if (options.pollInterval > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(options.pollInterval));
+		else
+			std::this_thread::yield();
+	}
+}
+
+static void HotplugThread(const SoakOptions& options, unsigned seed, uint64_t* events)
+{
+	std::mt19937 random(seed);
+	const std::chrono::nanoseconds period(options.hotplugRate > 0 ? 1000000000LL / options.hotplugRate : 0);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+
+	while (!gStop.load(std::memory_order_relaxed))
+	{
+		// Keep about half of the slots connected
+		uint32_t pick = random() % 3;
+		if (pick == 0 ? Replace(random) : pick == 1 ? Connect(random) : Disconnect(random))
+			++*events;
+
+		if (options.hotplugRate > 0)
+		{
+			deadline += period;
+			std::this_thread::sleep_until(deadline);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+#pragma endregion
+
+int main(int argc, char** argv)
+{
+	SoakOptions options;
+	options.threads = std::max(1, ParseOption(argc, argv, "threads", 4));
+	options.readerThreads = std::max(0, ParseOption(argc, argv, "reader-threads", 2));
+	options.rate = std::max(0, ParseOption(argc, argv, "rate", 1000));
+	options.seconds = std::max(1, ParseOption(argc, argv, "seconds", 10));
+	options.hotplugThreads = std::max(0, ParseOption(argc, argv, "hotplug-threads", 2));
+	options.hotplugRate = std::max(0, ParseOption(argc, argv, "hotplug-rate", 200));
+	options.pollInterval = std::max(0, ParseOption(argc, argv, "poll-interval", 4));
+	gReadingYields = ParseOption(argc, argv, "reading-yields", 0) != 0;
+	options.seed = static_cast<unsigned>(ParseOption(argc, argv, "seed", 1));
+
+	printf("soak: %d caller threads and %d broker readers at %d/s, %d hotplug threads at %d/s, broker poll every %dms, %ds, seed %u\n",
+		options.threads, options.readerThreads, options.rate, options.hotplugThreads, options.hotplugRate, options.pollInterval,
+		options.seconds, options.seed);
+
+	BrokerUnlink(SOAK_REGION_NAME);
+	gBroker = BrokerOpen(SOAK_REGION_NAME);
+	if (!gBroker)
+	{
+		fprintf(stderr, "can't map the broker region\n");
+		return 1;
+	}
+
+	HapticsSettings haptics;
+	haptics.LTriggerStrength = 0.25f;
+	haptics.RTriggerStrength = 0.25f;
+	haptics.LMotorStrength = 1.0f;
+	haptics.RMotorStrength = 1.0f;
+	haptics.TriggerSwap = false;
+	haptics.MotorSwap = false;
+	haptics.UpdateRate = 500;
+	haptics.AttackTime = 10;
+	haptics.DecayTime = 60;
+	haptics.TriggerPulseRate = 30;
+	HapticsBuildTables(haptics, &gHaptics.tables);
+	HapticsReset(&gHaptics);
+	HapticsStart(&gHaptics, haptics.UpdateRate, SimVibrationSink, NULL);
+
+	int callers = options.threads + options.readerThreads;
+	std::vector<Histogram> histograms(callers * SOAK_EXPORT_COUNT);
+	std::vector<uint64_t> hotplugEvents(options.hotplugThreads, 0);
+	uint64_t polls = 0;
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < callers; ++i)
+		threads.emplace_back(CallerThread, std::cref(options), options.seed * 7919 + i, i >= options.threads, &histograms[i * SOAK_EXPORT_COUNT]);
+	threads.emplace_back(BrokerThread, std::cref(options), &polls);
+	for (int i = 0; i < options.hotplugThreads; ++i)
+		threads.emplace_back(HotplugThread, std::cref(options), options.seed * 104729 + i, &hotplugEvents[i]);
+
+	std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+	gStop.store(true);
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	HapticsStop(&gHaptics);
+	ReleaseHapticsGamepads();
+	DisconnectAll();
+
+	BrokerClose(gBroker);
+	BrokerUnlink(SOAK_REGION_NAME);
+
+	uint64_t events = 0;
+	for (size_t i = 0; i < hotplugEvents.size(); ++i)
+		events += hotplugEvents[i];
+
+	printf("hotplug events: %llu, broker polls: %llu\n\n", static_cast<unsigned long long>(events), static_cast<unsigned long long>(polls));
+	printf("%-24s %12s %10s %10s %10s %10s\n", "export", "calls", "p50 us", "p99 us", "p99.9 us", "max us");
+
+	for (int e = 0; e < SOAK_EXPORT_COUNT; ++e)
+	{
+		Histogram merged;
+		for (int i = 0; i < callers; ++i)
+			merged.Merge(histograms[i * SOAK_EXPORT_COUNT + e]);
+
+		printf("%-24s %12llu %10.2f %10.2f %10.2f %10.2f\n", c_ExportNames[e],
+			static_cast<unsigned long long>(merged.total),
+			merged.Percentile(50) / 1000.0, merged.Percentile(99) / 1000.0,
+			merged.Percentile(99.9) / 1000.0, merged.max / 1000.0);
+	}
+
+	// Every slot is empty again, so every reader count must be back to zero
+	for (size_t slot = 0; slot < MAX_PLAYER_COUNT; ++slot)
+	{
+		if (racingWheels.readers[slot][0].load() != 0 || racingWheels.readers[slot][1].load() != 0)
+			Violation("reader count did not drain", static_cast<uint32_t>(slot));
+	}
+
+	if (gDevicesCreated.load() != gDevicesReleased.load())
+		Violation("devices leaked or released twice", static_cast<uint32_t>(gDevicesCreated.load() - gDevicesReleased.load()));
+
+	if (gGamepadsCreated.load() != gGamepadsReleased.load())
+		Violation("gamepads leaked or released twice", static_cast<uint32_t>(gGamepadsCreated.load() - gGamepadsReleased.load()));
+
+	printf("\ndevices: %llu created, %llu released\n",
+		static_cast<unsigned long long>(gDevicesCreated.load()), static_cast<unsigned long long>(gDevicesReleased.load()));
+	printf("gamepads: %llu created, %llu released\n",
+		static_cast<unsigned long long>(gGamepadsCreated.load()), static_cast<unsigned long long>(gGamepadsReleased.load()));
+	printf("invariant violations: %llu\n", static_cast<unsigned long long>(gViolations.load()));
+
+	return gViolations.load() == 0 ? 0 : 1;
+}
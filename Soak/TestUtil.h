@@ -0,0 +1,46 @@
+/*
+	Helpers shared by the programs in Soak/.
+
+	Check prints one "ok  :" or "FAIL:" line per check and counts the failures, ReportFailures
+	prints the count and turns it into the exit code. ParseOption reads --name=value arguments.
+
+	Inline so a program that only uses some of them builds without unused warnings.
+*/
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+inline int& TestFailures()
+{
+	static int failures = 0;
+	return failures;
+}
+
+inline void Check(bool condition, const char* what)
+{
+	printf("%s: %s\n", condition ? "ok  " : "FAIL", what);
+	if (!condition)
+		++TestFailures();
+}
+
+// Last thing main does, exits with 1 if a check failed
+inline int ReportFailures()
+{
+	printf("\nfailures: %d\n", TestFailures());
+	return TestFailures() == 0 ? 0 : 1;
+}
+
+inline int ParseOption(int argc, char** argv, const char* name, int fallback)
+{
+	std::string prefix = std::string("--") + name + "=";
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strncmp(argv[i], prefix.c_str(), prefix.size()) == 0)
+			return atoi(argv[i] + prefix.size());
+	}
+	return fallback;
+}
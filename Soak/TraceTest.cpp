@@ -0,0 +1,386 @@
+/*
+	Trace recorder test.
+
+	Records from several threads into small ring buffers (Trace.h) while another thread keeps
+	writing the trace out, then checks every file that was written:
+	- it is valid JSON,
+	- every thread's events are in order and its spans nest, even right after old events were overwritten,
+	- each full buffer kept its newest events and reports how many older ones were overwritten,
+	- threads past TRACE_MAX_THREADS go unrecorded and are counted,
+	- buffer sizes are rounded up to a power of two and capped.
+
+	Built on Linux by CMakeLists.txt in this folder, trace-test-tsan is the ThreadSanitizer build:
+		cmake -S Soak -B build && cmake --build build --target trace-test
+
+	Usage:
+		trace-test [--threads=8] [--iterations=5000]
+
+	Exits with 1 if a check failed.
+*/
+
+#include "TestUtil.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TEST_CAPACITY					200			// Rounded up to 256
+#define TEST_SAMPLE_RATE				4
+#define TEST_TRACE_PATH					"trace-test.json"
+
+static const char* c_OuterName = "outer \"quoted\" \\ name";
+static const char* c_InnerName = "inner";
+static const char* c_CappedName = "capped";
+
+#pragma region JSON
+
+// Just enough of a validating JSON parser to tell whether a trace viewer will load the file
+struct JsonParser
+{
+	const char* p;
+
+	void Space()
+	{
+		while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+			++p;
+	}
+
+	bool String()
+	{
+		if (*p++ != '"')
+			return false;
+		for (; *p != '"'; ++p)
+		{
+			if (*p == 0 || static_cast<unsigned char>(*p) < 0x20)
+				return false;
+			if (*p == '\\' && strchr("\"\\/bfnrtu", *++p) == NULL)
+				return false;
+		}
+		++p;
+		return true;
+	}
+
+	bool Number()
+	{
+		const char* start = p;
+		if (*p == '-')
+			++p;
+		while ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')
+			++p;
+		return p != start;
+	}
+
+	bool Value()
+	{
+		Space();
+		if (*p == '{')
+		{
+			++p;
+			Space();
+			if (*p == '}')
+				return ++p, true;
+			for (;;)
+			{
+				Space();
+				if (!String())
+					return false;
+				Space();
+				if (*p++ != ':' || !Value())
+					return false;
+				Space();
+				if (*p == '}')
+					return ++p, true;
+				if (*p++ != ',')
+					return false;
+			}
+		}
+		if (*p == '[')
+		{
+			++p;
+			Space();
+			if (*p == ']')
+				return ++p, true;
+			for (;;)
+			{
+				if (!Value())
+					return false;
+				Space();
+				if (*p == ']')
+					return ++p, true;
+				if (*p++ != ',')
+					return false;
+			}
+		}
+		if (*p == '"')
+			return String();
+		if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0)
+			return p += 4, true;
+		if (strncmp(p, "false", 5) == 0)
+			return p += 5, true;
+		return Number();
+	}
+};
+
+static bool ValidJson(const std::string& text)
+{
+	JsonParser parser = { text.c_str() };
+	if (!parser.Value())
+		return false;
+	parser.Space();
+	return *parser.p == 0;
+}
+
+#pragma endregion
+
+#pragma region Trace file
+
+struct ParsedEvent
+{
+	std::string name;
+	char phase;
+	double timestamp;
+	uint32_t tid;
+	uint64_t count;		// args.count of markers
+};
+
+static std::string ReadFile(const char* path)
+{
+	std::string text;
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return text;
+
+	char chunk[4096];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		text.append(chunk, read);
+	fclose(file);
+	return text;
+}
+
+// TraceWrite puts one event per line
+static std::vector<ParsedEvent> ParseEvents(const std::string& text)
+{
+	std::vector<ParsedEvent> events;
+	size_t start = 0;
+	while (start < text.size())
+	{
+		size_t end = text.find('\n', start);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string line = text.substr(start, end - start);
+		start = end + 1;
+
+		if (line.compare(0, 9, "{\"name\":\"") != 0)
+			continue;
+
+		ParsedEvent event;
+		size_t i = 9;
+		for (; i < line.size() && line[i] != '"'; ++i)
+		{
+			if (line[i] == '\\')
+				++i;
+			event.name += line[i];
+		}
+
+		size_t phase = line.find("\"ph\":\"");
+		size_t timestamp = line.find("\"ts\":");
+		size_t tid = line.find("\"tid\":");
+		size_t count = line.find("\"count\":");
+		if (phase == std::string::npos || timestamp == std::string::npos || tid == std::string::npos)
+			continue;
+
+		event.phase = line[phase + 6];
+		event.timestamp = atof(line.c_str() + timestamp + 5);
+		event.tid = static_cast<uint32_t>(strtoul(line.c_str() + tid + 6, NULL, 10));
+		event.count = count != std::string::npos ? strtoull(line.c_str() + count + 8, NULL, 10) : 0;
+		events.push_back(event);
+	}
+	return events;
+}
+
+// Spans must nest and time must not run backwards on any thread
+static bool WellFormed(const std::vector<ParsedEvent>& events)
+{
+	std::map<uint32_t, std::vector<std::string> > stacks;
+	std::map<uint32_t, double> last;
+
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const ParsedEvent& event = events[i];
+		if (event.phase == 'i')
+			continue;
+
+		if (last.count(event.tid) && event.timestamp < last[event.tid])
+			return false;
+		last[event.tid] = event.timestamp;
+
+		std::vector<std::string>& stack = stacks[event.tid];
+		if (event.phase == 'B')
+		{
+			stack.push_back(event.name);
+		}
+		else if (event.phase == 'E')
+		{
+			if (stack.empty() || stack.back() != event.name)
+				return false;
+			stack.pop_back();
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#pragma endregion
+
+static void RecordingThread(int iterations)
+{
+	for (int i = 0; i < iterations; ++i)
+	{
+		TraceScope outer(c_OuterName);
+		TraceScope inner(c_InnerName, TraceSample());
+	}
+}
+
+static void ConcurrentRecording(int threads, int iterations)
+{
+	std::vector<std::thread> recorders;
+	for (int i = 0; i < threads; ++i)
+		recorders.emplace_back(RecordingThread, iterations);
+
+	// Writes while the recorders keep overwriting their oldest events
+	int written = 0, valid = 0, wellFormed = 0;
+	for (int i = 0; i < 20; ++i)
+	{
+		if (!TraceWrite(TEST_TRACE_PATH))
+			continue;
+		++written;
+
+		std::string text = ReadFile(TEST_TRACE_PATH);
+		if (ValidJson(text))
+			++valid;
+		if (WellFormed(ParseEvents(text)))
+			++wellFormed;
+	}
+
+	for (size_t i = 0; i < recorders.size(); ++i)
+		recorders[i].join();
+
+	printf("      %d traces written while recording\n", written);
+	Check(written == 20 && valid == written, "traces written during recording are valid JSON");
+	Check(wellFormed == written, "traces written during recording are well formed");
+
+	Check(TraceWrite(TEST_TRACE_PATH), "final trace written");
+	std::string text = ReadFile(TEST_TRACE_PATH);
+	std::vector<ParsedEvent> events = ParseEvents(text);
+	Check(ValidJson(text) && WellFormed(events), "final trace is valid and well formed");
+
+	// Every thread recorded the same, so every buffer overwrote the same number of events
+	uint64_t sampled = (iterations + TEST_SAMPLE_RATE - 1) / TEST_SAMPLE_RATE;
+	uint64_t recorded = 2 * static_cast<uint64_t>(iterations) + 2 * sampled;
+	uint32_t capacity = 1;
+	while (capacity < TEST_CAPACITY)
+		capacity <<= 1;
+
+	std::map<uint32_t, uint64_t> overwritten;
+	std::map<uint32_t, size_t> kept;
+	std::map<uint32_t, const ParsedEvent*> newest;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		if (events[i].name == "overwritten events")
+			overwritten[events[i].tid] = events[i].count;
+		else if (events[i].phase != 'i')
+		{
+			++kept[events[i].tid];
+			newest[events[i].tid] = &events[i];
+		}
+	}
+
+	bool counts = kept.size() == static_cast<size_t>(threads) && overwritten.size() == kept.size();
+	bool latest = counts;
+	for (std::map<uint32_t, size_t>::const_iterator it = kept.begin(); it != kept.end(); ++it)
+	{
+		// The oldest slot is always given up, its thread could be overwriting it right now.
+		// A few leading ends may have been skipped because their begin was overwritten.
+		counts = counts && overwritten[it->first] == recorded - capacity + 1 && it->second < capacity && it->second > capacity - 4;
+		latest = latest && newest[it->first]->phase == 'E' && newest[it->first]->name == c_OuterName;
+	}
+
+	printf("      %llu events per thread, %u kept, %llu overwritten\n", (unsigned long long)recorded, capacity,
+		overwritten.empty() ? 0ULL : (unsigned long long)overwritten.begin()->second);
+	Check(counts, "full buffers keep the newest events and count the overwritten ones");
+	Check(latest, "the last event of every thread is in the trace");
+}
+
+static void ThreadCap(int recordedThreads)
+{
+	const int extra = 5;
+	const int threads = TRACE_MAX_THREADS - recordedThreads + extra;
+
+	// All alive at once so the OS can't hand out a thread id twice
+	std::atomic<int> started(0);
+	std::vector<std::thread> cappers;
+	for (int i = 0; i < threads; ++i)
+	{
+		cappers.emplace_back([&started, threads]()
+		{
+			{
+				TraceScope scope(c_CappedName);
+			}
+			started.fetch_add(1);
+			while (started.load() < threads)
+				std::this_thread::yield();
+		});
+	}
+	for (size_t i = 0; i < cappers.size(); ++i)
+		cappers[i].join();
+
+	Check(TraceWrite(TEST_TRACE_PATH), "trace written after hitting the thread cap");
+	std::string text = ReadFile(TEST_TRACE_PATH);
+	std::vector<ParsedEvent> events = ParseEvents(text);
+
+	std::map<uint32_t, bool> tids;
+	uint64_t unrecorded = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		if (events[i].name == "unrecorded threads")
+			unrecorded = events[i].count;
+		else
+			tids[events[i].tid] = true;
+	}
+
+	printf("      %zu threads recorded, %llu unrecorded\n", tids.size(), (unsigned long long)unrecorded);
+	Check(ValidJson(text), "trace is valid JSON");
+	Check(tids.size() == TRACE_MAX_THREADS && unrecorded == static_cast<uint64_t>(extra), "threads past TRACE_MAX_THREADS are counted, not recorded");
+}
+
+int main(int argc, char** argv)
+{
+	int threads = std::max(1, std::min(ParseOption(argc, argv, "threads", 8), TRACE_MAX_THREADS - 1));
+	int iterations = std::max(TEST_CAPACITY, ParseOption(argc, argv, "iterations", 5000));
+
+	Check(!TraceEnabled() && !TraceSample(), "nothing is recorded before TraceInit");
+
+	// Nothing has been recorded yet, so TraceInit can still be called again
+	TraceInit(1000000000, TEST_SAMPLE_RATE);
+	Check(TraceCapacity() == TRACE_MAX_CAPACITY, "huge buffer sizes are capped");
+	TraceInit(TEST_CAPACITY, TEST_SAMPLE_RATE);
+	Check(TraceCapacity() == 256, "buffer sizes are rounded up to a power of two");
+
+	ConcurrentRecording(threads, iterations);
+	ThreadCap(threads);
+
+	remove(TEST_TRACE_PATH);
+
+	return ReportFailures();
+}
@@ -0,0 +1,284 @@
+// Doesn't use the precompiled header so the tracking can be built without windows.h on other platforms.
+#include "AllocTrack.h"
+
+#ifdef X1NPUT_ALLOC_TRACKING
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+#define ALLOCTRACK_CRT_HOOK
+#include <crtdbg.h>
+#endif
+
+#ifdef ALLOCTRACK_INTERPOSE
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+static AllocTrackStats g_AllocTrackStats[ALLOCTRACK_EXPORT_COUNT];
+static std::atomic<uint32_t> g_AllocTrackWarmup(ALLOCTRACK_DEFAULT_WARMUP);
+
+// Plain counters of the calling thread, nothing here may allocate
+static thread_local uint64_t t_Allocations = 0;
+static thread_local uint64_t t_Locks = 0;
+static thread_local uint32_t t_Calls[ALLOCTRACK_EXPORT_COUNT];
+static thread_local uint32_t t_Depth = 0;
+
+#pragma region Hooks
+#ifdef ALLOCTRACK_CRT_HOOK
+static int __cdecl AllocTrackCrtHook(int allocType, void*, size_t, int, long, const unsigned char*, int)
+{
+	if (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC)
+		AllocTrackNoteAllocation();
+	return 1;
+}
+#elif defined(ALLOCTRACK_INTERPOSE)
+// Our definitions come first in the lookup order, the real functions are found with RTLD_NEXT.
+// dlsym may allocate while looking one up, those allocations come from a small static arena.
+alignas(16) static char g_AllocTrackArena[16384];
+static std::atomic<size_t> g_AllocTrackArenaUsed(0);
+static thread_local bool t_Resolving = false;
+
+static std::atomic<void* (*)(size_t)> g_RealMalloc(NULL);
+static std::atomic<void* (*)(size_t, size_t)> g_RealCalloc(NULL);
+static std::atomic<void* (*)(void*, size_t)> g_RealRealloc(NULL);
+static std::atomic<void (*)(void*)> g_RealFree(NULL);
+static std::atomic<int (*)(pthread_mutex_t*)> g_RealMutexLock(NULL);
+static std::atomic<int (*)(pthread_mutex_t*)> g_RealMutexTryLock(NULL);
+static std::atomic<int (*)(pthread_rwlock_t*)> g_RealRwlockRdlock(NULL);
+static std::atomic<int (*)(pthread_rwlock_t*)> g_RealRwlockWrlock(NULL);
+static std::atomic<int (*)(pthread_rwlock_t*)> g_RealRwlockTryRdlock(NULL);
+static std::atomic<int (*)(pthread_rwlock_t*)> g_RealRwlockTryWrlock(NULL);
+
+template<typename T>
+static T AllocTrackResolve(std::atomic<T>& real, const char* name)
+{
+	T function = real.load(std::memory_order_acquire);
+	if (!function)
+	{
+		t_Resolving = true;
+		function = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+		t_Resolving = false;
+		real.store(function, std::memory_order_release);
+	}
+	return function;
+}
+
+static void* AllocTrackArenaAlloc(size_t size)
+{
+	size = (size + 15) & ~static_cast<size_t>(15);
+	size_t offset = g_AllocTrackArenaUsed.fetch_add(size, std::memory_order_relaxed);
+	return offset + size <= sizeof(g_AllocTrackArena) ? g_AllocTrackArena + offset : NULL;
+}
+
+static bool AllocTrackInArena(void* memory)
+{
+	return memory >= static_cast<void*>(g_AllocTrackArena) && memory < static_cast<void*>(g_AllocTrackArena + sizeof(g_AllocTrackArena));
+}
+
+extern "C" void* malloc(size_t size) noexcept
+{
+	if (t_Resolving)
+		return AllocTrackArenaAlloc(size);
+
+	AllocTrackNoteAllocation();
+	return AllocTrackResolve(g_RealMalloc, "malloc")(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) noexcept
+{
+	if (t_Resolving)
+	{
+		// The arena is never reused, so it is still zero
+		return size == 0 || count <= sizeof(g_AllocTrackArena) / size ? AllocTrackArenaAlloc(count * size) : NULL;
+	}
+
+	AllocTrackNoteAllocation();
+	return AllocTrackResolve(g_RealCalloc, "calloc")(count, size);
+}
+
+extern "C" void* realloc(void* memory, size_t size) noexcept
+{
+	if (t_Resolving)
+		return AllocTrackArenaAlloc(size);
+
+	AllocTrackNoteAllocation();
+	if (AllocTrackInArena(memory))
+	{
+		// Only dlsym's own blocks live there, copy what's left of the arena at most
+		void* moved = AllocTrackResolve(g_RealMalloc, "malloc")(size);
+		size_t available = static_cast<size_t>(g_AllocTrackArena + sizeof(g_AllocTrackArena) - static_cast<char*>(memory));
+		if (moved)
+			memcpy(moved, memory, size < available ? size : available);
+		return moved;
+	}
+	return AllocTrackResolve(g_RealRealloc, "realloc")(memory, size);
+}
+
+extern "C" void free(void* memory) noexcept
+{
+	// Arena blocks are never given back, and nothing can be freed while free itself is being looked up
+	if (memory == NULL || AllocTrackInArena(memory) || (t_Resolving && !g_RealFree.load(std::memory_order_acquire)))
+		return;
+
+	AllocTrackResolve(g_RealFree, "free")(memory);
+}
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealMutexLock, "pthread_mutex_lock")(mutex);
+}
+
+extern "C" int pthread_mutex_trylock(pthread_mutex_t* mutex) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealMutexTryLock, "pthread_mutex_trylock")(mutex);
+}
+
+extern "C" int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealRwlockRdlock, "pthread_rwlock_rdlock")(rwlock);
+}
+
+extern "C" int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealRwlockWrlock, "pthread_rwlock_wrlock")(rwlock);
+}
+
+extern "C" int pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealRwlockTryRdlock, "pthread_rwlock_tryrdlock")(rwlock);
+}
+
+extern "C" int pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock) noexcept
+{
+	AllocTrackNoteLock();
+	return AllocTrackResolve(g_RealRwlockTryWrlock, "pthread_rwlock_trywrlock")(rwlock);
+}
+#else
+// No debug CRT hook or interposition here, count every operator new instead
+void* operator new(size_t size)
+{
+	AllocTrackNoteAllocation();
+	void* memory = malloc(size ? size : 1);
+	if (!memory)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	AllocTrackNoteAllocation();
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	free(memory);
+}
+#endif
+
+void AllocTrackInstall(uint32_t warmupCalls)
+{
+	g_AllocTrackWarmup.store(warmupCalls, std::memory_order_relaxed);
+
+#ifdef ALLOCTRACK_CRT_HOOK
+	_CrtSetAllocHook(AllocTrackCrtHook);
+#endif
+}
+
+void AllocTrackNoteAllocation()
+{
+	++t_Allocations;
+}
+
+void AllocTrackNoteLock()
+{
+	++t_Locks;
+}
+#pragma endregion
+
+#pragma region Stats
+const AllocTrackStats& AllocTrackGetStats(AllocTrackExport which)
+{
+	return g_AllocTrackStats[which];
+}
+
+const char* AllocTrackExportName(AllocTrackExport which)
+{
+	switch (which)
+	{
+	case ALLOCTRACK_GET_STATE: return "XInputGetState";
+	case ALLOCTRACK_GET_STATE_EX: return "XInputGetStateEx";
+	case ALLOCTRACK_SET_STATE: return "XInputSetState";
+	default: return "?";
+	}
+}
+
+AllocTrackScope::AllocTrackScope(AllocTrackExport which)
+	: m_export(which), m_nested(t_Depth++ > 0), m_allocations(t_Allocations), m_locks(t_Locks)
+{
+}
+
+AllocTrackScope::~AllocTrackScope()
+{
+	--t_Depth;
+
+	// The outer export counts the call, and everything it allocated or locked
+	if (m_nested)
+		return;
+
+	AllocTrackStats& stats = g_AllocTrackStats[m_export];
+
+	stats.calls.fetch_add(1, std::memory_order_relaxed);
+
+	// Warm-up is per thread, every game thread lazily sets up its own trace buffer etc.
+	if (t_Calls[m_export] < g_AllocTrackWarmup.load(std::memory_order_relaxed))
+	{
+		++t_Calls[m_export];
+		return;
+	}
+
+	uint64_t allocations = t_Allocations - m_allocations;
+	uint64_t locks = t_Locks - m_locks;
+	if (allocations == 0 && locks == 0)
+		return;
+
+	stats.allocations.fetch_add(allocations, std::memory_order_relaxed);
+	stats.locks.fetch_add(locks, std::memory_order_relaxed);
+	stats.violations.fetch_add(1, std::memory_order_relaxed);
+}
+#pragma endregion
+
+#endif
@@ -0,0 +1,99 @@
+/*
+	Allocation and lock tracking for the per-frame exports (debug builds only).
+
+	XInputGetState, XInputGetStateEx and XInputSetState are called every frame, often from
+	several threads, and must not allocate or take a lock once everything is initialized.
+	Wrapping an export in ALLOCTRACK_SCOPE counts the heap allocations and lock acquisitions
+	made by the calling thread during the call. After the first calls of each export on each thread
+	(initialization, lazily created buffers) any allocation or lock counts as a violation.
+
+	With MSVC, allocations are counted through the debug CRT allocation hook, and locks where
+	our own code takes them, through ALLOCTRACK_NOTE_LOCK: InitializeRacingWheel while initialization
+	may still block, the trace trigger and ScanRacingWheels. Allocations and locks inside WinRT itself
+	aren't visible.
+	On Linux (the Soak tests) malloc/calloc/realloc and the pthread mutex and rwlock functions are
+	interposed instead, so every allocation and lock counts, annotated or not. Sanitizer builds keep
+	their own interceptors and fall back to replacing the global operator new.
+
+	A scope inside another one (XInputGetStateEx calling XInputGetState) counts for the outer export only.
+
+	Release builds compile all of this away. Define X1NPUT_ALLOC_TRACKING to force it on.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(_DEBUG) && !defined(X1NPUT_ALLOC_TRACKING)
+#define X1NPUT_ALLOC_TRACKING
+#endif
+
+#define ALLOCTRACK_DEFAULT_WARMUP		64			// Calls per export and thread that may allocate
+
+#if defined(__has_feature)
+#if __has_feature(thread_sanitizer) || __has_feature(address_sanitizer)
+#define ALLOCTRACK_SANITIZED
+#endif
+#endif
+#if defined(__SANITIZE_THREAD__) || defined(__SANITIZE_ADDRESS__)
+#define ALLOCTRACK_SANITIZED
+#endif
+
+// Whether allocations and locks are seen without ALLOCTRACK_NOTE_LOCK
+#if defined(X1NPUT_ALLOC_TRACKING) && defined(__linux__) && !defined(ALLOCTRACK_SANITIZED)
+#define ALLOCTRACK_INTERPOSE
+#endif
+
+enum AllocTrackExport
+{
+	ALLOCTRACK_GET_STATE = 0,
+	ALLOCTRACK_GET_STATE_EX,
+	ALLOCTRACK_SET_STATE,
+	ALLOCTRACK_EXPORT_COUNT,
+};
+
+struct AllocTrackStats
+{
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> allocations;	// After warm-up
+	std::atomic<uint64_t> locks;		// After warm-up
+	std::atomic<uint64_t> violations;	// Calls that allocated or locked after warm-up
+};
+
+#ifdef X1NPUT_ALLOC_TRACKING
+
+// Installs the allocation hook. Calls made before this only see locks.
+void AllocTrackInstall(uint32_t warmupCalls);
+
+void AllocTrackNoteAllocation();
+void AllocTrackNoteLock();
+
+const AllocTrackStats& AllocTrackGetStats(AllocTrackExport which);
+const char* AllocTrackExportName(AllocTrackExport which);
+
+class AllocTrackScope
+{
+public:
+	explicit AllocTrackScope(AllocTrackExport which);
+	~AllocTrackScope();
+
+private:
+	AllocTrackScope(const AllocTrackScope&);
+	AllocTrackScope& operator=(const AllocTrackScope&);
+
+	AllocTrackExport m_export;
+	bool m_nested;
+	uint64_t m_allocations;
+	uint64_t m_locks;
+};
+
+#define ALLOCTRACK_SCOPE(which)		AllocTrackScope allocTrackScope(which)
+#define ALLOCTRACK_NOTE_LOCK()		AllocTrackNoteLock()
+
+#else
+
+#define ALLOCTRACK_SCOPE(which)		((void)0)
+#define ALLOCTRACK_NOTE_LOCK()		((void)0)
+
+#endif
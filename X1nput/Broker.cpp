@@ -0,0 +1,270 @@
+// Doesn't use the precompiled header so the broker can be built without windows.h on other platforms.
+#include "Broker.h"
+
+#include <chrono>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Runs between claiming the heartbeat and claiming the owner, so a stress test can stretch that window.
+// Define it as the name of a function to call there.
+#ifdef BROKER_ACQUIRE_HOOK
+void BROKER_ACQUIRE_HOOK();
+#else
+#define BROKER_ACQUIRE_HOOK()			((void)0)
+#endif
+
+#pragma region Mapping
+// Claims a fresh (zero-filled) region or checks that an existing one is compatible.
+// The version goes in before the magic, so an instance that sees the magic also sees the version.
+static bool BrokerValidate(BrokerRegion* region)
+{
+	uint32_t version = 0;
+	if (!region->version.compare_exchange_strong(version, BROKER_VERSION) && version != BROKER_VERSION)
+		return false;
+
+	uint32_t magic = 0;
+	if (!region->magic.compare_exchange_strong(magic, BROKER_MAGIC) && magic != BROKER_MAGIC)
+		return false;
+
+	return true;
+}
+
+#ifdef _WIN32
+BrokerRegion* BrokerOpen(const char* name)
+{
+	// Local\ keeps the region inside the current session, like the game and its launcher.
+	std::string fullName = std::string("Local\\") + name;
+
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(BrokerRegion), fullName.c_str());
+	if (mapping == NULL)
+		return NULL;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(BrokerRegion));
+
+	// The view keeps the section alive, the handle isn't needed anymore.
+	CloseHandle(mapping);
+
+	if (view == NULL)
+		return NULL;
+
+	BrokerRegion* region = static_cast<BrokerRegion*>(view);
+	if (!BrokerValidate(region))
+	{
+		UnmapViewOfFile(view);
+		return NULL;
+	}
+
+	return region;
+}
+
+void BrokerClose(BrokerRegion* region)
+{
+	if (region)
+		UnmapViewOfFile(region);
+}
+
+void BrokerUnlink(const char*)
+{
+	// Sections are reference counted, the name goes away with the last view.
+}
+
+uint32_t BrokerProcessId()
+{
+	return GetCurrentProcessId();
+}
+#else
+BrokerRegion* BrokerOpen(const char* name)
+{
+	std::string fullName = std::string("/") + name;
+
+	int fd = shm_open(fullName.c_str(), O_CREAT | O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+
+	// Growing a zero-length object zero-fills it, shrinking never happens since every instance asks for the same size.
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (info.st_size < (off_t)sizeof(BrokerRegion) && ftruncate(fd, sizeof(BrokerRegion)) != 0))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void* view = mmap(NULL, sizeof(BrokerRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (view == MAP_FAILED)
+		return NULL;
+
+	BrokerRegion* region = static_cast<BrokerRegion*>(view);
+	if (!BrokerValidate(region))
+	{
+		munmap(view, sizeof(BrokerRegion));
+		return NULL;
+	}
+
+	return region;
+}
+
+void BrokerClose(BrokerRegion* region)
+{
+	if (region)
+		munmap(region, sizeof(BrokerRegion));
+}
+
+void BrokerUnlink(const char* name)
+{
+	std::string fullName = std::string("/") + name;
+	shm_unlink(fullName.c_str());
+}
+
+uint32_t BrokerProcessId()
+{
+	return static_cast<uint32_t>(getpid());
+}
+#endif
+
+// steady_clock is QueryPerformanceCounter on Windows and CLOCK_MONOTONIC on Linux, both are system-wide.
+uint64_t BrokerNow()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#pragma endregion
+
+#pragma region Ownership
+bool BrokerTryAcquire(BrokerRegion* region, uint32_t id, uint64_t now, uint64_t timeoutMs)
+{
+	uint32_t owner = region->ownerId.load(std::memory_order_acquire);
+	if (owner == id)
+		return true;
+
+	uint64_t heartbeat = region->heartbeat.load(std::memory_order_acquire);
+	if (owner != 0 && (now < heartbeat || now - heartbeat < timeoutMs))
+		return false;
+
+	// Several instances may notice a stale or missing owner at the same time. Claiming the heartbeat
+	// first lets only one of them through: the others' compare-and-swap fails, and anyone who sees
+	// the new owner also sees its fresh heartbeat. Claiming the owner first would leave a window
+	// where the new owner still has the stale heartbeat and could be taken over in turn.
+	if (!region->heartbeat.compare_exchange_strong(heartbeat, now, std::memory_order_acq_rel))
+		return false;
+
+	BROKER_ACQUIRE_HOOK();
+
+	if (!region->ownerId.compare_exchange_strong(owner, id, std::memory_order_acq_rel))
+		return false;
+
+	region->ownerEpoch.fetch_add(1, std::memory_order_acq_rel);
+
+	// An owner that died mid-write leaves its slot odd forever, reopen those slots.
+	for (size_t i = 0; i < BROKER_SLOT_COUNT; ++i)
+	{
+		uint32_t sequence = region->slots[i].sequence.load(std::memory_order_relaxed);
+		if (sequence & 1)
+			region->slots[i].sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_release);
+	}
+
+	return true;
+}
+
+bool BrokerIsOwner(const BrokerRegion* region, uint32_t id)
+{
+	return region->ownerId.load(std::memory_order_acquire) == id;
+}
+
+void BrokerHeartbeat(BrokerRegion* region, uint64_t now)
+{
+	region->heartbeat.store(now, std::memory_order_release);
+}
+
+void BrokerRelease(BrokerRegion* region, uint32_t id)
+{
+	// Readers have nothing to hand over, and the slots belong to the owner
+	if (region->ownerId.load(std::memory_order_acquire) != id)
+		return;
+
+	// Clear the slots first so readers don't keep reporting wheels nobody polls anymore.
+	// A new owner republishes them on its first poll.
+	uint32_t empty[BROKER_CAPS_WORDS] = {};
+	for (size_t i = 0; i < BROKER_SLOT_COUNT; ++i)
+		BrokerWriteSlot(region->slots[i], false, empty, empty);
+
+	uint32_t owner = id;
+	region->ownerId.compare_exchange_strong(owner, 0, std::memory_order_acq_rel);
+}
+#pragma endregion
+
+#pragma region Vibration
+void BrokerSubmitVibration(BrokerRegion* region, size_t index, uint16_t leftSpeed, uint16_t rightSpeed)
+{
+	BrokerSlot& slot = region->slots[index];
+	slot.vibration.store(static_cast<uint32_t>(leftSpeed) | (static_cast<uint32_t>(rightSpeed) << 16), std::memory_order_relaxed);
+	slot.vibrationPending.store(1, std::memory_order_release);
+}
+
+bool BrokerTakeVibration(BrokerRegion* region, size_t index, uint16_t* leftSpeed, uint16_t* rightSpeed)
+{
+	BrokerSlot& slot = region->slots[index];
+	if (slot.vibrationPending.load(std::memory_order_relaxed) == 0 || slot.vibrationPending.exchange(0, std::memory_order_acquire) == 0)
+		return false;
+
+	// A command submitted after the exchange may already show up here, it is then simply taken twice
+	uint32_t command = slot.vibration.load(std::memory_order_relaxed);
+	*leftSpeed = static_cast<uint16_t>(command & 0xFFFF);
+	*rightSpeed = static_cast<uint16_t>(command >> 16);
+	return true;
+}
+#pragma endregion
+
+#pragma region Seqlock
+bool BrokerWriteSlot(BrokerSlot& slot, bool connected, const uint32_t* state, const uint32_t* caps)
+{
+	// Odd sequence marks the slot as being written, which also keeps a stalled ex-owner from writing concurrently.
+	uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	if ((sequence & 1) || !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+		return false;
+
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.connected.store(connected ? 1 : 0, std::memory_order_relaxed);
+	for (size_t i = 0; i < BROKER_STATE_WORDS; ++i)
+		slot.state[i].store(state[i], std::memory_order_relaxed);
+	for (size_t i = 0; i < BROKER_CAPS_WORDS; ++i)
+		slot.caps[i].store(caps[i], std::memory_order_relaxed);
+
+	slot.sequence.store(sequence + 2, std::memory_order_release);
+	return true;
+}
+
+bool BrokerReadSlot(const BrokerSlot& slot, uint32_t* state, uint32_t* caps)
+{
+	for (int attempt = 0; attempt < BROKER_READ_RETRIES; ++attempt)
+	{
+		uint32_t before = slot.sequence.load(std::memory_order_acquire);
+		if (before & 1)
+			continue;
+
+		bool connected = slot.connected.load(std::memory_order_relaxed) != 0;
+		for (size_t i = 0; i < BROKER_STATE_WORDS; ++i)
+			state[i] = slot.state[i].load(std::memory_order_relaxed);
+		for (size_t i = 0; i < BROKER_CAPS_WORDS; ++i)
+			caps[i] = slot.caps[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (slot.sequence.load(std::memory_order_relaxed) == before)
+			return connected;
+	}
+
+	return false;
+}
+#pragma endregion
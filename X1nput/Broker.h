@@ -0,0 +1,127 @@
+/*
+	Shared-memory input broker.
+
+	When several processes load the DLL (launcher, overlay, game), only the first one
+	talks to Windows.Gaming.Input. It polls the wheels and publishes the translated
+	XINPUT_STATE and XINPUT_CAPABILITIES of every slot into a named shared-memory region.
+	Every other instance reads the slots back without doing any WinRT work.
+
+	Each slot is guarded by a seqlock. The payload is stored as relaxed atomic words so
+	readers never race with the writer, and a reader that keeps seeing a torn slot
+	gives up and reports the device as disconnected.
+
+	Vibration goes the other way: a reader's XInputSetState leaves the command in the slot
+	and the owner picks it up on its next poll and plays it on the wheel.
+
+	The owner refreshes a heartbeat on every poll. When it exits it releases the region,
+	and if it dies without doing so the heartbeat goes stale; in both cases the next
+	instance to notice claims ownership with a compare-and-swap.
+
+	This file does not depend on windows.h so the protocol can be built on Linux (shm_open).
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define BROKER_MAGIC					0x58314E42	// 'X1NB'
+#define BROKER_VERSION					2
+#define BROKER_SLOT_COUNT				8
+
+#define BROKER_STATE_WORDS				4			// sizeof(XINPUT_STATE) / 4
+#define BROKER_CAPS_WORDS				5			// sizeof(XINPUT_CAPABILITIES) / 4
+
+#define BROKER_READ_RETRIES				64
+
+#define BROKER_DEFAULT_NAME				"X1nputBroker"
+
+struct BrokerSlot
+{
+	std::atomic<uint32_t>				sequence;	// Odd while the owner is writing
+	std::atomic<uint32_t>				connected;
+	std::atomic<uint32_t>				state[BROKER_STATE_WORDS];
+	std::atomic<uint32_t>				caps[BROKER_CAPS_WORDS];
+
+	// Written by readers, taken by the owner. Not part of the seqlock, the command is a single word.
+	std::atomic<uint32_t>				vibration;	// Left motor speed in the low word
+	std::atomic<uint32_t>				vibrationPending;
+};
+
+struct BrokerRegion
+{
+	std::atomic<uint32_t>				magic;
+	std::atomic<uint32_t>				version;
+	std::atomic<uint32_t>				ownerId;	// Process id of the owner, 0 if nobody owns the region
+	std::atomic<uint32_t>				ownerEpoch;	// Incremented on every handover
+	std::atomic<uint64_t>				heartbeat;	// Owner's last poll, in milliseconds of a system-wide monotonic clock
+	BrokerSlot							slots[BROKER_SLOT_COUNT];
+};
+
+// A freshly created mapping is zero-filled, which is a valid empty region.
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Broker needs address-free 32-bit atomics");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Broker needs address-free 64-bit atomics");
+
+// Maps (creating if needed) the named region. Returns NULL if the region can't be mapped
+// or was created by an incompatible version of the DLL.
+BrokerRegion* BrokerOpen(const char* name);
+void BrokerClose(BrokerRegion* region);
+
+// Removes the name so the next BrokerOpen creates a fresh region. Existing mappings stay valid.
+void BrokerUnlink(const char* name);
+
+uint32_t BrokerProcessId();
+uint64_t BrokerNow();
+
+// Claims ownership if the region has no owner or the owner's heartbeat is older than timeoutMs.
+// Returns true if 'id' owns the region afterwards, for exactly one of several callers racing for it.
+bool BrokerTryAcquire(BrokerRegion* region, uint32_t id, uint64_t now, uint64_t timeoutMs);
+bool BrokerIsOwner(const BrokerRegion* region, uint32_t id);
+void BrokerHeartbeat(BrokerRegion* region, uint64_t now);
+// Clears the slots and gives up ownership. Does nothing unless 'id' owns the region.
+void BrokerRelease(BrokerRegion* region, uint32_t id);
+
+// Seqlock writer. Returns false if another writer holds the slot (e.g. a stalled ex-owner).
+bool BrokerWriteSlot(BrokerSlot& slot, bool connected, const uint32_t* state, const uint32_t* caps);
+
+// Seqlock reader. Returns false if the slot is disconnected or couldn't be read consistently.
+bool BrokerReadSlot(const BrokerSlot& slot, uint32_t* state, uint32_t* caps);
+
+// Reader side of XInputSetState, the latest command wins
+void BrokerSubmitVibration(BrokerRegion* region, size_t index, uint16_t leftSpeed, uint16_t rightSpeed);
+
+// Owner side: returns true and the command if a reader submitted one since the last call
+bool BrokerTakeVibration(BrokerRegion* region, size_t index, uint16_t* leftSpeed, uint16_t* rightSpeed);
+
+template<typename TState, typename TCaps>
+bool BrokerPublish(BrokerRegion* region, size_t index, bool connected, const TState& state, const TCaps& caps)
+{
+	static_assert(sizeof(TState) == BROKER_STATE_WORDS * 4, "Unexpected state size");
+	static_assert(sizeof(TCaps) == BROKER_CAPS_WORDS * 4, "Unexpected capabilities size");
+
+	uint32_t stateWords[BROKER_STATE_WORDS];
+	uint32_t capsWords[BROKER_CAPS_WORDS];
+	memcpy(stateWords, &state, sizeof(stateWords));
+	memcpy(capsWords, &caps, sizeof(capsWords));
+
+	return BrokerWriteSlot(region->slots[index], connected, stateWords, capsWords);
+}
+
+// Either output may be NULL.
+template<typename TState, typename TCaps>
+bool BrokerRead(const BrokerRegion* region, size_t index, TState* state, TCaps* caps)
+{
+	static_assert(sizeof(TState) == BROKER_STATE_WORDS * 4, "Unexpected state size");
+	static_assert(sizeof(TCaps) == BROKER_CAPS_WORDS * 4, "Unexpected capabilities size");
+
+	uint32_t stateWords[BROKER_STATE_WORDS];
+	uint32_t capsWords[BROKER_CAPS_WORDS];
+	if (!BrokerReadSlot(region->slots[index], stateWords, capsWords))
+		return false;
+
+	if (state) memcpy(state, stateWords, sizeof(stateWords));
+	if (caps) memcpy(caps, capsWords, sizeof(capsWords));
+	return true;
+}
@@ -0,0 +1,115 @@
+/*
+	Device slots shared between the game's threads and the hotplug callbacks.
+
+	Game threads call the exports concurrently while RacingWheelAdded/RacingWheelRemoved
+	rescan on a WinRT callback thread. Readers borrow a slot without taking a lock:
+	they announce themselves on one of the slot's two reader counts, then load the pointer.
+	A writer swaps the pointer, points new readers at the other count and waits for the
+	old count to drain before handing the old device back. A device is therefore only
+	released once no call can still be using it, and since new readers land on the other
+	count, a steady stream of calls can't keep the writer waiting.
+
+	A reader can be preempted between picking a count and incrementing it. Meanwhile a writer
+	may flip the counts and the next one put a new device in without flipping, so the reader
+	would announce itself on the count nobody waits for anymore and still borrow the new device.
+	Readers therefore check that the counts weren't flipped around their increment, and retry if they were.
+
+	Writers must be serialized by the caller, readers never wait.
+
+	Header-only and free of windows.h so the soak harness can use it on Linux.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+// Runs between a reader picking its count and incrementing it, so a test can interleave a writer there
+#ifndef DEVICESLOTS_BORROW_HOOK
+#define DEVICESLOTS_BORROW_HOOK()		((void)0)
+#endif
+
+template<typename T, size_t N>
+struct DeviceSlots
+{
+	std::atomic<T*> devices[N];
+	std::atomic<uint32_t> epochs[N];		// Which of the two reader counts new readers use
+	std::atomic<uint32_t> readers[N][2];
+};
+
+// Borrows a slot for the lifetime of the object. Get() is NULL if the slot is empty.
+template<typename T, size_t N>
+class DeviceSlotBorrow
+{
+public:
+	DeviceSlotBorrow(DeviceSlots<T, N>& slots, size_t index)
+		: m_readers(NULL), m_device(NULL)
+	{
+		if (index >= N)
+			return;
+
+		// Everything is seq_cst: either the writer sees this reader, or this reader sees the new pointer.
+		// That only holds if no flip came between picking the count and incrementing it.
+		for (;;)
+		{
+			uint32_t epoch = slots.epochs[index].load(std::memory_order_seq_cst);
+			m_readers = &slots.readers[index][epoch & 1];
+
+			DEVICESLOTS_BORROW_HOOK();
+
+			m_readers->fetch_add(1, std::memory_order_seq_cst);
+			if (slots.epochs[index].load(std::memory_order_seq_cst) == epoch)
+				break;
+
+			m_readers->fetch_sub(1, std::memory_order_release);
+		}
+
+		m_device = slots.devices[index].load(std::memory_order_seq_cst);
+	}
+
+	~DeviceSlotBorrow()
+	{
+		if (m_readers)
+			m_readers->fetch_sub(1, std::memory_order_release);
+	}
+
+	T* Get() const { return m_device; }
+	T* operator->() const { return m_device; }
+
+private:
+	DeviceSlotBorrow(const DeviceSlotBorrow&);
+	DeviceSlotBorrow& operator=(const DeviceSlotBorrow&);
+
+	std::atomic<uint32_t>* m_readers;
+	T* m_device;
+};
+
+// Writer side only: the current device, without borrowing
+template<typename T, size_t N>
+T* DeviceSlotsPeek(const DeviceSlots<T, N>& slots, size_t index)
+{
+	return slots.devices[index].load(std::memory_order_acquire);
+}
+
+// Puts 'device' into the slot and returns the previous one once no reader can still be using it.
+// The slot takes over the caller's reference to 'device', the caller gets the one to the old device.
+template<typename T, size_t N>
+T* DeviceSlotsExchange(DeviceSlots<T, N>& slots, size_t index, T* device)
+{
+	T* previous = slots.devices[index].exchange(device, std::memory_order_seq_cst);
+
+	if (previous)
+	{
+		uint32_t epoch = slots.epochs[index].fetch_add(1, std::memory_order_seq_cst) & 1;
+
+		// Only calls that started before the flip count here, and they are short (one reading).
+		// A late reader that still picked this count sees the flip and moves to the other one.
+		// Reading 0 synchronizes with the readers' release decrements, their last use happens before ours
+		while (slots.readers[index][epoch].load(std::memory_order_seq_cst) != 0)
+			std::this_thread::yield();
+	}
+
+	return previous;
+}
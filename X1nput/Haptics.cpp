@@ -0,0 +1,227 @@
+// Doesn't use the precompiled header so the synthesizer can be built without windows.h on other platforms.
+#include "Haptics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+static const float c_Pi = 3.14159265f;
+
+#pragma region Tables
+static int EnvelopeLength(float milliseconds, int updateRate)
+{
+	int length = static_cast<int>(milliseconds * updateRate / 1000.f + 0.5f);
+	return std::max(1, std::min(length, HAPTICS_MAX_ENVELOPE));
+}
+
+void HapticsBuildTables(const HapticsSettings& settings, HapticsTables* tables)
+{
+	int updateRate = std::max(1, settings.UpdateRate);
+
+	// Attack rises quickly and eases into the target, a quarter sine
+	tables->attackLength = EnvelopeLength(settings.AttackTime, updateRate);
+	for (int i = 0; i < tables->attackLength; ++i)
+	{
+		float x = static_cast<float>(i + 1) / tables->attackLength;
+		tables->attack[i] = sinf(x * c_Pi / 2);
+	}
+
+	// Decay falls off exponentially, normalized so the last tick lands on the target
+	tables->decayLength = EnvelopeLength(settings.DecayTime, updateRate);
+	const float falloff = 4.f;
+	for (int i = 0; i < tables->decayLength; ++i)
+	{
+		float x = static_cast<float>(i + 1) / tables->decayLength;
+		tables->decay[i] = (1.f - expf(-falloff * x)) / (1.f - expf(-falloff));
+	}
+	tables->attack[tables->attackLength - 1] = 1.f;
+	tables->decay[tables->decayLength - 1] = 1.f;
+
+	// One period of the trigger pulse train: a short raised-cosine bump, then a quieter tail
+	for (int i = 0; i < HAPTICS_PULSE_TABLE_SIZE; ++i)
+	{
+		float x = static_cast<float>(i) / HAPTICS_PULSE_TABLE_SIZE;
+		tables->pulse[i] = (x < 0.5f) ? 0.5f - 0.5f * cosf(x * 4 * c_Pi) : 0.25f;
+	}
+
+	if (settings.TriggerPulseRate > 0)
+	{
+		double step = settings.TriggerPulseRate / updateRate;
+		tables->pulseIncrement = static_cast<uint32_t>(std::min(step, 0.5) * 4294967296.0);
+	}
+	else
+	{
+		// Steady trigger: stay on the top of the bump
+		for (int i = 0; i < HAPTICS_PULSE_TABLE_SIZE; ++i)
+			tables->pulse[i] = 1.f;
+		tables->pulseIncrement = 0;
+	}
+
+	// Same mapping as the old direct XInputSetState code, including the swaps
+	for (int c = 0; c < HAPTICS_CHANNEL_COUNT; ++c)
+		tables->mix[c][0] = tables->mix[c][1] = 0;
+
+	tables->mix[HAPTICS_LEFT_MOTOR][settings.MotorSwap ? 1 : 0] = settings.LMotorStrength;
+	tables->mix[HAPTICS_RIGHT_MOTOR][settings.MotorSwap ? 0 : 1] = settings.RMotorStrength;
+	tables->mix[HAPTICS_LEFT_TRIGGER][settings.TriggerSwap ? 1 : 0] = settings.LTriggerStrength;
+	tables->mix[HAPTICS_RIGHT_TRIGGER][settings.TriggerSwap ? 0 : 1] = settings.RTriggerStrength;
+}
+#pragma endregion
+
+#pragma region Synthesis
+void HapticsReset(HapticsEngine* engine)
+{
+	for (size_t i = 0; i < HAPTICS_SLOT_COUNT; ++i)
+	{
+		HapticsSlot& slot = engine->slots[i];
+		slot.command.store(0, std::memory_order_relaxed);
+		slot.reset.store(false, std::memory_order_relaxed);
+		slot.applied = 0;
+		slot.phase = 0;
+		slot.last = HapticsFrame();
+		slot.active = false;
+
+		for (int c = 0; c < HAPTICS_CHANNEL_COUNT; ++c)
+			slot.envelopes[c] = HapticsEnvelope();
+	}
+}
+
+void HapticsSubmit(HapticsEngine* engine, size_t slot, uint16_t leftSpeed, uint16_t rightSpeed)
+{
+	if (slot >= HAPTICS_SLOT_COUNT)
+		return;
+
+	uint32_t command = static_cast<uint32_t>(leftSpeed) | (static_cast<uint32_t>(rightSpeed) << 16);
+	engine->slots[slot].command.store(command, std::memory_order_relaxed);
+}
+
+void HapticsResetSlot(HapticsEngine* engine, size_t slot)
+{
+	if (slot >= HAPTICS_SLOT_COUNT)
+		return;
+
+	// A command submitted for the next device after this is kept, the tick only clears the synthesis state
+	engine->slots[slot].command.store(0, std::memory_order_relaxed);
+	engine->slots[slot].reset.store(true, std::memory_order_release);
+}
+
+static void RetargetEnvelope(HapticsEnvelope& envelope, float target)
+{
+	if (target == envelope.to)
+		return;
+
+	envelope.from = envelope.value;
+	envelope.to = target;
+	envelope.index = 0;
+	envelope.rising = target > envelope.value;
+}
+
+static float AdvanceEnvelope(HapticsEnvelope& envelope, const HapticsTables& tables)
+{
+	const float* curve = envelope.rising ? tables.attack : tables.decay;
+	int length = envelope.rising ? tables.attackLength : tables.decayLength;
+
+	if (envelope.index < length)
+	{
+		envelope.value = envelope.from + (envelope.to - envelope.from) * curve[envelope.index];
+		++envelope.index;
+	}
+
+	return envelope.value;
+}
+
+void HapticsTick(HapticsEngine* engine)
+{
+	const HapticsTables& tables = engine->tables;
+
+	for (size_t i = 0; i < HAPTICS_SLOT_COUNT; ++i)
+	{
+		HapticsSlot& slot = engine->slots[i];
+
+		if (slot.reset.load(std::memory_order_relaxed) && slot.reset.exchange(false, std::memory_order_acquire))
+		{
+			slot.applied = 0;
+			slot.phase = 0;
+			slot.last = HapticsFrame();
+			slot.active = false;
+
+			for (int c = 0; c < HAPTICS_CHANNEL_COUNT; ++c)
+				slot.envelopes[c] = HapticsEnvelope();
+		}
+
+		uint32_t command = slot.command.load(std::memory_order_relaxed);
+		if (command != slot.applied)
+		{
+			float speeds[2] = { (command & 0xFFFF) / 65535.0f, (command >> 16) / 65535.0f };
+			for (int c = 0; c < HAPTICS_CHANNEL_COUNT; ++c)
+			{
+				float target = speeds[0] * tables.mix[c][0] + speeds[1] * tables.mix[c][1];
+				RetargetEnvelope(slot.envelopes[c], std::min(target, 1.f));
+			}
+			slot.applied = command;
+		}
+
+		float pulse = tables.pulse[slot.phase >> (32 - HAPTICS_PULSE_TABLE_BITS)];
+		slot.phase += tables.pulseIncrement;
+
+		HapticsFrame frame;
+		frame.LeftMotor = AdvanceEnvelope(slot.envelopes[HAPTICS_LEFT_MOTOR], tables);
+		frame.RightMotor = AdvanceEnvelope(slot.envelopes[HAPTICS_RIGHT_MOTOR], tables);
+		frame.LeftTrigger = AdvanceEnvelope(slot.envelopes[HAPTICS_LEFT_TRIGGER], tables) * pulse;
+		frame.RightTrigger = AdvanceEnvelope(slot.envelopes[HAPTICS_RIGHT_TRIGGER], tables) * pulse;
+
+		bool silent = frame.LeftMotor == 0 && frame.RightMotor == 0 && frame.LeftTrigger == 0 && frame.RightTrigger == 0;
+
+		// Only talk to the device when something changed, an idle slot costs nothing
+		if (silent && !slot.active)
+			continue;
+
+		if (frame.LeftMotor != slot.last.LeftMotor || frame.RightMotor != slot.last.RightMotor ||
+			frame.LeftTrigger != slot.last.LeftTrigger || frame.RightTrigger != slot.last.RightTrigger)
+		{
+			engine->sink(engine->context, i, frame);
+			slot.last = frame;
+		}
+
+		slot.active = !silent;
+	}
+}
+#pragma endregion
+
+#pragma region Timer
+void HapticsStart(HapticsEngine* engine, int updateRate, HapticsSink sink, void* context)
+{
+	engine->sink = sink;
+	engine->context = context;
+	engine->stop.store(false);
+
+	const std::chrono::nanoseconds period(1000000000LL / std::max(1, updateRate));
+
+	engine->thread = std::thread([engine, period]()
+	{
+		// Deadlines are absolute so a late tick doesn't push every following tick back
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+
+		while (!engine->stop.load(std::memory_order_relaxed))
+		{
+			HapticsTick(engine);
+
+			deadline += period;
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			// After a long stall (debugger, suspended process) skip the missed ticks instead of bursting through them
+			if (now - deadline > period * 4)
+				deadline = now;
+
+			std::this_thread::sleep_until(deadline);
+		}
+	});
+}
+
+void HapticsStop(HapticsEngine* engine)
+{
+	engine->stop.store(true);
+	if (engine->thread.joinable())
+		engine->thread.join();
+}
+#pragma endregion
@@ -0,0 +1,129 @@
+/*
+	Impulse-trigger haptics synthesizer.
+
+	Games call XInputSetState whenever they like, usually once per frame, with two motor speeds.
+	Sending those straight to the triggers gives a flat buzz that only changes at the game's frame rate.
+
+	Instead, XInputSetState only stores the latest command and a timer thread running at a fixed
+	rate expands it into four envelopes (two motors, two triggers):
+	- a change in speed ramps along the attack or decay curve instead of jumping,
+	- the triggers are additionally modulated by a pulse train so they feel like impulses.
+
+	All curves are precomputed into tables from the [Triggers], [Motors] and [Haptics] settings
+	when the config is loaded, the timer thread only does table lookups.
+
+	This file does not depend on windows.h, the output goes through a sink callback.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#define HAPTICS_SLOT_COUNT				8
+#define HAPTICS_CHANNEL_COUNT			4			// Left motor, right motor, left trigger, right trigger
+#define HAPTICS_MAX_ENVELOPE			512			// Longest attack/decay table, in ticks
+#define HAPTICS_PULSE_TABLE_BITS		6
+#define HAPTICS_PULSE_TABLE_SIZE		(1 << HAPTICS_PULSE_TABLE_BITS)
+
+enum HapticsChannel
+{
+	HAPTICS_LEFT_MOTOR = 0,
+	HAPTICS_RIGHT_MOTOR,
+	HAPTICS_LEFT_TRIGGER,
+	HAPTICS_RIGHT_TRIGGER,
+};
+
+struct HapticsSettings
+{
+	float LTriggerStrength;
+	float RTriggerStrength;
+	float LMotorStrength;
+	float RMotorStrength;
+	bool TriggerSwap;
+	bool MotorSwap;
+
+	int UpdateRate;				// Ticks per second
+	float AttackTime;			// Milliseconds to ramp up to a stronger command
+	float DecayTime;			// Milliseconds to fade down to a weaker command
+	float TriggerPulseRate;		// Trigger pulses per second, 0 for a steady trigger
+};
+
+// Same layout as ABI::Windows::Gaming::Input::GamepadVibration
+struct HapticsFrame
+{
+	float LeftMotor;
+	float RightMotor;
+	float LeftTrigger;
+	float RightTrigger;
+};
+
+typedef void (*HapticsSink)(void* context, size_t slot, const HapticsFrame& frame);
+
+struct HapticsTables
+{
+	// Progress curves going from 0 to 1, the last entry is always 1
+	float attack[HAPTICS_MAX_ENVELOPE];
+	float decay[HAPTICS_MAX_ENVELOPE];
+	int attackLength;
+	int decayLength;
+
+	float pulse[HAPTICS_PULSE_TABLE_SIZE];
+	uint32_t pulseIncrement;	// Phase step per tick, the full period is 2^32
+
+	// Per output channel: strength applied to each of the game's motor speeds (left, right)
+	float mix[HAPTICS_CHANNEL_COUNT][2];
+};
+
+struct HapticsEnvelope
+{
+	float value;
+	float from;
+	float to;
+	int index;
+	bool rising;
+};
+
+struct HapticsSlot
+{
+	std::atomic<uint32_t> command;	// Latest XINPUT_VIBRATION, left speed in the low word
+	std::atomic<bool> reset;		// Set by HapticsResetSlot, taken by the timer thread
+	uint32_t applied;				// Command the envelopes are heading to
+	HapticsEnvelope envelopes[HAPTICS_CHANNEL_COUNT];
+	uint32_t phase;
+	HapticsFrame last;
+	bool active;					// Whether the sink has seen a non-zero frame
+};
+
+struct HapticsEngine
+{
+	HapticsTables tables;
+	HapticsSlot slots[HAPTICS_SLOT_COUNT];
+
+	HapticsSink sink;
+	void* context;
+
+	std::atomic<bool> stop;
+	std::thread thread;
+};
+
+void HapticsBuildTables(const HapticsSettings& settings, HapticsTables* tables);
+
+// Resets all slots, must not be called while the timer thread runs
+void HapticsReset(HapticsEngine* engine);
+
+// Called from XInputSetState, only publishes the command for the next tick
+void HapticsSubmit(HapticsEngine* engine, size_t slot, uint16_t leftSpeed, uint16_t rightSpeed);
+
+// Called once the slot's device is gone: drops its command, and the next tick starts the slot over
+// without telling the sink, so the next device neither inherits the old vibration nor misses the first command
+void HapticsResetSlot(HapticsEngine* engine, size_t slot);
+
+// Advances every slot by one tick and hands changed frames to the sink
+void HapticsTick(HapticsEngine* engine);
+
+// Starts the timer thread ticking at the table's update rate
+void HapticsStart(HapticsEngine* engine, int updateRate, HapticsSink sink, void* context);
+void HapticsStop(HapticsEngine* engine);
@@ -0,0 +1,296 @@
+// Doesn't use the precompiled header so the recorder can be built without windows.h on other platforms.
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<bool> g_TraceEnabled(false);
+static uint32_t g_TraceCapacity = TRACE_DEFAULT_CAPACITY;
+static uint32_t g_TraceSampleRate = 1;
+
+static std::atomic<TraceBuffer*> g_TraceBuffers[TRACE_MAX_THREADS];
+static std::atomic<uint32_t> g_TraceBufferCount(0);
+static std::atomic<uint32_t> g_TraceUnrecordedThreads(0);
+
+static thread_local TraceBuffer* t_TraceBuffer = NULL;
+static thread_local bool t_TraceUnrecorded = false;
+static thread_local uint32_t t_TraceSampleCounter = 0;
+
+#pragma region Platform
+static uint32_t TraceThreadId()
+{
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#else
+	return static_cast<uint32_t>(syscall(SYS_gettid));
+#endif
+}
+
+static uint32_t TraceProcessId()
+{
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	return static_cast<uint32_t>(getpid());
+#endif
+}
+
+static FILE* TraceOpen(const char* path)
+{
+#ifdef _MSC_VER
+	FILE* file = NULL;
+	return fopen_s(&file, path, "w") == 0 ? file : NULL;
+#else
+	return fopen(path, "w");
+#endif
+}
+
+static uint64_t TraceNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#pragma endregion
+
+#pragma region Recording
+void TraceInit(uint32_t capacity, uint32_t sampleRate)
+{
+	if (capacity == 0)
+		capacity = TRACE_DEFAULT_CAPACITY;
+
+	// A power of two keeps the ring index a mask instead of a division.
+	// The buffer is allocated inside whichever export records first, so its size is bounded.
+	g_TraceCapacity = 1;
+	while (g_TraceCapacity < capacity && g_TraceCapacity < TRACE_MAX_CAPACITY)
+		g_TraceCapacity <<= 1;
+
+	g_TraceSampleRate = sampleRate > 0 ? sampleRate : 1;
+	g_TraceEnabled.store(true, std::memory_order_release);
+}
+
+bool TraceEnabled()
+{
+	return g_TraceEnabled.load(std::memory_order_acquire);
+}
+
+uint32_t TraceCapacity()
+{
+	return g_TraceCapacity;
+}
+
+// Allocates the calling thread's buffer on its first event
+static TraceBuffer* TraceThreadBuffer()
+{
+	if (t_TraceBuffer || t_TraceUnrecorded)
+		return t_TraceBuffer;
+
+	uint32_t index = g_TraceBufferCount.load(std::memory_order_relaxed);
+	do
+	{
+		if (index >= TRACE_MAX_THREADS)
+		{
+			// Too many threads, this one goes unrecorded
+			t_TraceUnrecorded = true;
+			g_TraceUnrecordedThreads.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+	} while (!g_TraceBufferCount.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+	// No exception may leave an export, a thread that can't get its buffer goes unrecorded
+	TraceBuffer* buffer = new (std::nothrow) TraceBuffer();
+	TraceEvent* events = new (std::nothrow) TraceEvent[g_TraceCapacity];
+	if (!buffer || !events)
+	{
+		delete buffer;
+		delete[] events;
+		t_TraceUnrecorded = true;
+		g_TraceUnrecordedThreads.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	buffer->threadId = TraceThreadId();
+	buffer->capacity = g_TraceCapacity;
+	buffer->count.store(0, std::memory_order_relaxed);
+	buffer->events = events;
+
+	// TraceWrite may see the reserved index before the pointer, it skips empty entries
+	g_TraceBuffers[index].store(buffer, std::memory_order_release);
+
+	t_TraceBuffer = buffer;
+	return buffer;
+}
+
+static void TraceRecord(const char* name, char phase)
+{
+	if (!TraceEnabled())
+		return;
+
+	TraceBuffer* buffer = TraceThreadBuffer();
+	if (!buffer)
+		return;
+
+	// Only this thread writes to the buffer, the release store publishes the event to TraceWrite.
+	// The fence keeps the overwrite from becoming visible before the count that says the old event is going away,
+	// like the writer side of a seqlock.
+	uint64_t count = buffer->count.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	TraceEvent& event = buffer->events[count & (buffer->capacity - 1)];
+	event.name.store(name, std::memory_order_relaxed);
+	event.timestamp.store(TraceNow(), std::memory_order_relaxed);
+	event.phase.store(phase, std::memory_order_relaxed);
+
+	buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void TraceBegin(const char* name)
+{
+	TraceRecord(name, 'B');
+}
+
+void TraceEnd(const char* name)
+{
+	TraceRecord(name, 'E');
+}
+
+bool TraceSample()
+{
+	if (!TraceEnabled())
+		return false;
+
+	return (t_TraceSampleCounter++ % g_TraceSampleRate) == 0;
+}
+#pragma endregion
+
+#pragma region Export
+static void TraceWriteString(FILE* file, const char* text)
+{
+	fputc('"', file);
+	for (; *text; ++text)
+	{
+		if (*text == '"' || *text == '\\')
+			fputc('\\', file);
+		fputc(*text, file);
+	}
+	fputc('"', file);
+}
+
+struct TraceSnapshotEvent
+{
+	const char* name;
+	uint64_t timestamp;
+	char phase;
+};
+
+// Copies the events still in the buffer, oldest first, and returns how many older ones were overwritten
+static uint64_t TraceSnapshot(const TraceBuffer* buffer, std::vector<TraceSnapshotEvent>& events)
+{
+	const uint64_t capacity = buffer->capacity;
+
+	uint64_t end = buffer->count.load(std::memory_order_acquire);
+	uint64_t begin = end > capacity ? end - capacity : 0;
+
+	events.resize(static_cast<size_t>(end - begin));
+	for (uint64_t i = begin; i < end; ++i)
+	{
+		const TraceEvent& event = buffer->events[i & (capacity - 1)];
+		TraceSnapshotEvent& copy = events[static_cast<size_t>(i - begin)];
+		copy.name = event.name.load(std::memory_order_relaxed);
+		copy.timestamp = event.timestamp.load(std::memory_order_relaxed);
+		copy.phase = event.phase.load(std::memory_order_relaxed);
+	}
+
+	// Event i may have been overwritten while copying if the thread got to event i + capacity
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t now = buffer->count.load(std::memory_order_relaxed);
+	uint64_t valid = now >= capacity ? now - capacity + 1 : 0;
+	if (valid > begin)
+	{
+		size_t stale = static_cast<size_t>(valid - begin < end - begin ? valid - begin : end - begin);
+		events.erase(events.begin(), events.begin() + stale);
+		begin += stale;
+	}
+
+	return begin;
+}
+
+bool TraceWrite(const char* path)
+{
+	FILE* file = TraceOpen(path);
+	if (!file)
+		return false;
+
+	const uint32_t pid = TraceProcessId();
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	uint32_t bufferCount = g_TraceBufferCount.load(std::memory_order_acquire);
+	if (bufferCount > TRACE_MAX_THREADS)
+		bufferCount = TRACE_MAX_THREADS;
+
+	std::vector<TraceSnapshotEvent> events;
+	for (uint32_t i = 0; i < bufferCount; ++i)
+	{
+		TraceBuffer* buffer = g_TraceBuffers[i].load(std::memory_order_acquire);
+		if (!buffer)
+			continue;
+
+		uint64_t overwritten = TraceSnapshot(buffer, events);
+		if (overwritten > 0 && !events.empty())
+		{
+			// Shows up as a marker at the start of the thread's track
+			fprintf(file, first ? "" : ",\n");
+			first = false;
+			fprintf(file, "{\"name\":\"overwritten events\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%u,\"tid\":%u,\"args\":{\"count\":%llu}}",
+				static_cast<unsigned long long>(events[0].timestamp / 1000), pid, buffer->threadId,
+				static_cast<unsigned long long>(overwritten));
+		}
+
+		// Ends whose begin was overwritten would close spans that don't exist
+		int depth = 0;
+		for (size_t j = 0; j < events.size(); ++j)
+		{
+			const TraceSnapshotEvent& event = events[j];
+			if (event.phase == 'E' && depth == 0)
+				continue;
+			depth += event.phase == 'B' ? 1 : -1;
+
+			fprintf(file, first ? "" : ",\n");
+			first = false;
+
+			fprintf(file, "{\"name\":");
+			TraceWriteString(file, event.name);
+			fprintf(file, ",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%u,\"tid\":%u}",
+				event.phase,
+				static_cast<unsigned long long>(event.timestamp / 1000),
+				static_cast<unsigned>(event.timestamp % 1000),
+				pid, buffer->threadId);
+		}
+	}
+
+	uint32_t unrecorded = g_TraceUnrecordedThreads.load(std::memory_order_relaxed);
+	if (unrecorded > 0)
+	{
+		// More than TRACE_MAX_THREADS threads recorded something, the rest are missing
+		fprintf(file, first ? "" : ",\n");
+		first = false;
+		fprintf(file, "{\"name\":\"unrecorded threads\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%llu,\"pid\":%u,\"tid\":0,\"args\":{\"count\":%u}}",
+			static_cast<unsigned long long>(TraceNow() / 1000), pid, unrecorded);
+	}
+
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
+#pragma endregion
@@ -0,0 +1,81 @@
+/*
+	Timeline tracing in the Chrome trace-event format (chrome://tracing, Perfetto).
+
+	Every thread appends begin/end events to its own fixed-size ring buffer, so recording
+	takes no lock and never waits on other threads. A buffer is allocated the first time
+	a thread records something; once it is full, the oldest events are overwritten, so a
+	trace written after a long session still shows its last moments. Buffers are never freed,
+	the recording can be written out at any time, also while other threads keep recording.
+
+	Event names must be string literals (or otherwise live forever), only the pointer is stored.
+
+	This file does not depend on windows.h so the recorder can be built on Linux.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define TRACE_MAX_THREADS				64
+#define TRACE_DEFAULT_CAPACITY			16384		// Events per thread
+#define TRACE_MAX_CAPACITY				(1 << 20)	// 24MB per thread
+
+// Fields are relaxed atomics so TraceWrite can read an event while its thread overwrites it,
+// TraceWrite then notices from the count and throws the event away.
+struct TraceEvent
+{
+	std::atomic<const char*> name;
+	std::atomic<uint64_t> timestamp;	// Nanoseconds, steady clock
+	std::atomic<char> phase;			// 'B' or 'E'
+};
+
+struct TraceBuffer
+{
+	uint32_t threadId;
+	uint32_t capacity;					// Power of two
+	std::atomic<uint64_t> count;		// Events ever recorded, the last 'capacity' of them are kept
+	TraceEvent* events;
+};
+
+// Enables recording. Must be called before any thread records, capacity is per thread,
+// rounded up to a power of two and capped at TRACE_MAX_CAPACITY.
+void TraceInit(uint32_t capacity, uint32_t sampleRate);
+bool TraceEnabled();
+
+// Events kept per thread, as TraceInit settled on
+uint32_t TraceCapacity();
+
+void TraceBegin(const char* name);
+void TraceEnd(const char* name);
+
+// True once every sampleRate calls on the calling thread, for events too frequent to record all of them
+bool TraceSample();
+
+// Writes everything recorded so far as a JSON trace. Safe to call while other threads keep recording.
+bool TraceWrite(const char* path);
+
+// Records a begin event now and the matching end event when it goes out of scope
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name, bool record = true)
+		: m_name((record && TraceEnabled()) ? name : NULL)
+	{
+		if (m_name)
+			TraceBegin(m_name);
+	}
+
+	~TraceScope()
+	{
+		if (m_name)
+			TraceEnd(m_name);
+	}
+
+private:
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+
+	const char* m_name;
+};
@@ -62,7 +62,15 @@ using namespace Microsoft::WRL::Wrappers;
 const float c_XboxOneThumbDeadZone = .24f;  // Recommended Xbox One controller deadzone
 
 ComPtr<IRacingWheelStatics> racingWheelStatics;
-ComPtr<IRacingWheel> racingWheels[MAX_PLAYER_COUNT];
+// Each slot holds a reference to its wheel, see DeviceSlots.h
+DeviceSlots<IRacingWheel, MAX_PLAYER_COUNT> racingWheels;
+typedef DeviceSlotBorrow<IRacingWheel, MAX_PLAYER_COUNT> RacingWheelBorrow;
+
+// Serializes ScanRacingWheels, hotplug events and XInputEnable may rescan at the same time
+SRWLOCK gScanLock = SRWLOCK_INIT;
+// Incremented when a scan starts and when it ends, so it is odd while one runs.
+// Background threads refresh what they cache per wheel when it changes.
+std::atomic<uint32_t> gScanGeneration(0);
 EventRegistrationToken mUserChangeToken[MAX_PLAYER_COUNT];
 
 EventRegistrationToken gAddedToken;
@@ -78,6 +86,17 @@ float LMotorStrength = 1.0f;
 bool TriggerSwap = false;
 bool MotorSwap = false;
 
+bool HapticsEnabled = false;
+int HapticsUpdateRate = 500;
+HapticsEngine gHaptics;
+
+bool TraceEnabledConfig = false;
+int TraceTriggerKey = 0;
+
+bool BrokerEnabled = false;
+int BrokerPollInterval = 4;
+int BrokerOwnerTimeout = 500;
+
 // Config related methods, thanks to xiaohe521, https://www.codeproject.com/Articles/10809/A-Small-Class-to-Read-INI-File
 #pragma region Config loading
 float GetConfigFloat(LPCTSTR AppName, LPCTSTR KeyName, LPCTSTR Default) {
@@ -86,6 +105,10 @@ float GetConfigFloat(LPCTSTR AppName, LPCTSTR KeyName, LPCTSTR Default) {
 	return _tstof(result);
 }
 
+int GetConfigInt(LPCTSTR AppName, LPCTSTR KeyName, INT Default) {
+	return GetPrivateProfileInt(AppName, KeyName, Default, CONFIG_PATH);
+}
+
 bool GetConfigBool(LPCTSTR AppName, LPCTSTR KeyName, LPCTSTR Default) {
 	TCHAR result[256];
 	GetPrivateProfileString(AppName, KeyName, Default, result, 256, CONFIG_PATH);
@@ -101,6 +124,35 @@ void GetConfig() {
 	LMotorStrength = GetConfigFloat(_T("Motors"), _T("LeftStrength"), _T("1.0"));
 	RMotorStrength = GetConfigFloat(_T("Motors"), _T("RightStrength"), _T("1.0"));
 	MotorSwap = GetConfigBool(_T("Motors"), _T("SwapSides"), _T("False"));
+
+	HapticsSettings haptics;
+	haptics.LTriggerStrength = LTriggerStrength;
+	haptics.RTriggerStrength = RTriggerStrength;
+	haptics.LMotorStrength = LMotorStrength;
+	haptics.RMotorStrength = RMotorStrength;
+	haptics.TriggerSwap = TriggerSwap;
+	haptics.MotorSwap = MotorSwap;
+	haptics.UpdateRate = HapticsUpdateRate = std::max(1, GetConfigInt(_T("Haptics"), _T("UpdateRate"), 500));
+	haptics.AttackTime = GetConfigFloat(_T("Haptics"), _T("AttackTime"), _T("10"));
+	haptics.DecayTime = GetConfigFloat(_T("Haptics"), _T("DecayTime"), _T("60"));
+	haptics.TriggerPulseRate = GetConfigFloat(_T("Haptics"), _T("TriggerPulseRate"), _T("30"));
+	HapticsEnabled = GetConfigBool(_T("Haptics"), _T("Enabled"), _T("False"));
+
+	// The synthesizer only does table lookups, everything is precomputed here
+	HapticsBuildTables(haptics, &gHaptics.tables);
+
+	TraceEnabledConfig = GetConfigBool(_T("Trace"), _T("Enabled"), _T("False"));
+	TraceTriggerKey = GetConfigInt(_T("Trace"), _T("TriggerKey"), 0);
+	if (TraceEnabledConfig && !TraceEnabled())
+	{
+		// Buffers are sized once, before any thread records
+		TraceInit(GetConfigInt(_T("Trace"), _T("BufferSize"), TRACE_DEFAULT_CAPACITY), GetConfigInt(_T("Trace"), _T("ExportSampleRate"), 64));
+		std::cout << "Trace: " << TraceCapacity() << " events per thread" << std::endl;
+	}
+
+	BrokerEnabled = GetConfigBool(_T("Broker"), _T("Enabled"), _T("False"));
+	BrokerPollInterval = std::max(1, GetConfigInt(_T("Broker"), _T("PollInterval"), 4));
+	BrokerOwnerTimeout = std::max(50, GetConfigInt(_T("Broker"), _T("OwnerTimeout"), 500));
 }
 #pragma endregion
 
@@ -132,6 +184,13 @@ bool ReconnectIO(bool OpenNewConsole)
 	return MadeConsole;
 }
 
+// Keeps the DLL loaded for the lifetime of the process, for background threads running its code
+void PinModule()
+{
+	HMODULE module;
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, reinterpret_cast<LPCTSTR>(&PinModule), &module);
+}
+
 // Gamepad scanning and racingWheel related methods
 #pragma region Stuff from GamePad.cpp
 
@@ -204,8 +263,14 @@ static HRESULT UserChanged(ABI::Windows::Gaming::Input::IGameController*, ABI::W
 // Scans for racingWheels (adds/removes racingWheels from racingWheels array)
 void ScanRacingWheels()
 {
+	TraceScope trace("ScanRacingWheels");
 	std::cout << "ScanRacingWheels" << std::endl;
 
+	ALLOCTRACK_NOTE_LOCK();
+	AcquireSRWLockExclusive(&gScanLock);
+	// Ordered before the slot exchanges below, see PublishRacingWheels
+	gScanGeneration.fetch_add(1, std::memory_order_seq_cst);
+
 	ComPtr<IVectorView<RacingWheel*>> wheels;
 	HRESULT hr = racingWheelStatics->get_RacingWheels(&wheels);
 	assert(SUCCEEDED(hr));
@@ -219,14 +284,14 @@ void ScanRacingWheels()
 	// Check for removed racingWheels
 	for (size_t j = 0; j < MAX_PLAYER_COUNT; ++j)
 	{
-		if (racingWheels[j])
+		if (DeviceSlotsPeek(racingWheels, j))
 		{
 			unsigned int k = 0;
 			for (; k < count; ++k)
 			{
 				ComPtr<IRacingWheel> wheel;
 				hr = wheels->GetAt(k, wheel.GetAddressOf());
-				if (SUCCEEDED(hr) && (wheel == racingWheels[j]))
+				if (SUCCEEDED(hr) && (wheel.Get() == DeviceSlotsPeek(racingWheels, j)))
 				{
 					break;
 				}
@@ -234,15 +299,23 @@ void ScanRacingWheels()
 
 			if (k >= count)
 			{
+				// Returns once no export can still be using the wheel
+				ComPtr<IRacingWheel> removed;
+				removed.Attach(DeviceSlotsExchange(racingWheels, j, static_cast<IRacingWheel*>(NULL)));
+
+				// No XInputSetState can reach the old wheel anymore, don't let its last command carry over to the next one
+				if (HapticsEnabled)
+					HapticsResetSlot(&gHaptics, j);
+
 				ComPtr<IGameController> ctrl;
-				hr = racingWheels[j].As(&ctrl);
+				hr = removed.As(&ctrl);
 				if (SUCCEEDED(hr) && ctrl)
 				{
+					TraceBegin("remove_UserChanged");
 					(void)ctrl->remove_UserChanged(mUserChangeToken[j]);
+					TraceEnd("remove_UserChanged");
 					mUserChangeToken[j].value = 0;
 				}
-
-				racingWheels[j].Reset();
 			}
 		}
 	}
@@ -258,13 +331,13 @@ void ScanRacingWheels()
 			size_t k = 0;
 			for (; k < MAX_PLAYER_COUNT; ++k)
 			{
-				if (racingWheels[k] == wheel)
+				if (DeviceSlotsPeek(racingWheels, k) == wheel.Get())
 				{
 					if (j == (count - 1))
 						mMostRecentWheel = static_cast<int>(k);
 					break;
 				}
-				else if (!racingWheels[k])
+				else if (!DeviceSlotsPeek(racingWheels, k))
 				{
 					if (empty >= MAX_PLAYER_COUNT)
 						empty = k;
@@ -276,7 +349,8 @@ void ScanRacingWheels()
 				// Silently ignore "extra" racingWheels as there's no hard limit
 				if (empty < MAX_PLAYER_COUNT)
 				{
-					racingWheels[empty] = wheel;
+					// The slot keeps its own reference
+					DeviceSlotsExchange(racingWheels, empty, ComPtr<IRacingWheel>(wheel).Detach());
 					if (j == (count - 1))
 						mMostRecentWheel = static_cast<int>(empty);
 
@@ -285,18 +359,24 @@ void ScanRacingWheels()
 					if (SUCCEEDED(hr) && ctrl)
 					{
 						typedef __FITypedEventHandler_2_Windows__CGaming__CInput__CIGameController_Windows__CSystem__CUserChangedEventArgs UserHandler;
+						TraceBegin("add_UserChanged");
 						hr = ctrl->add_UserChanged(Callback<UserHandler>(UserChanged).Get(), &mUserChangeToken[empty]);
+						TraceEnd("add_UserChanged");
 						assert(SUCCEEDED(hr));
 					}
 				}
 			}
 		}
 	}
+
+	gScanGeneration.fetch_add(1, std::memory_order_release);
+	ReleaseSRWLockExclusive(&gScanLock);
 }
 
 // GamepadAdded Event
 static HRESULT RacingWheelAdded(IInspectable *, ABI::Windows::Gaming::Input::IRacingWheel*)
 {
+	TraceScope trace("RacingWheelAdded");
 	std::cout << "RacingWheelAdded" << std::endl;
 
 	ScanRacingWheels();
@@ -306,6 +386,7 @@ static HRESULT RacingWheelAdded(IInspectable *, ABI::Windows::Gaming::Input::IRa
 // GamepadRemoved Event
 static HRESULT RacingWheelRemoved(IInspectable *, ABI::Windows::Gaming::Input::IRacingWheel*)
 {
+	TraceScope trace("RacingWheelRemoved");
 	std::cout << "RacingWheelRemoved" << std::endl;
 
 	ScanRacingWheels();
@@ -329,8 +410,27 @@ BOOL CALLBACK InitHandleFunction(
 	PVOID Parameter,
 	PVOID *lpContext);
 
+void InitializeWinRT();
+
+// Defined in the broker region below
+bool StartBroker();
+
+// Defined in the trace region below
+void StartTraceWriter();
+
+// Defined in the haptics region below
+void StartHaptics();
+void StopHaptics();
+
 bool InitializeRacingWheel()
 {
+	// Once initialized this is a plain check. Until then InitOnceExecuteOnce may block on another thread initializing.
+	BOOL pending = FALSE;
+	if (InitOnceBeginInitialize(&g_InitOnce, INIT_ONCE_CHECK_ONLY, &pending, NULL) && !pending)
+		return true;
+
+	ALLOCTRACK_NOTE_LOCK();
+
 	// Execute the initialization callback function 
 	BOOL bStatus = InitOnceExecuteOnce(&g_InitOnce,          // One-time initialization structure
 		InitHandleFunction,   // Pointer to initialization callback function
@@ -349,34 +449,63 @@ BOOL CALLBACK InitHandleFunction(
 {
 	ReconnectIO(true);
 
+	GetConfig();
+
+	// Tracing is only known to be enabled once the config is loaded
+	TraceScope trace("InitHandleFunction");
+	StartTraceWriter();
+
+#ifdef X1NPUT_ALLOC_TRACKING
+	AllocTrackInstall(ALLOCTRACK_DEFAULT_WARMUP);
+#endif
+
+	// In broker mode only the process owning the shared region talks to WinRT
+	if (BrokerEnabled && StartBroker())
+		return TRUE;
+
+	InitializeWinRT();
+
+	return TRUE;
+}
+
+// Activates the RacingWheel statics, registers hotplug events and does the initial scan.
+// Haptics output needs the wheels too, so the synthesizer runs wherever WinRT does.
+void InitializeWinRT()
+{
+	TraceBegin("RoInitialize");
 	HRESULT hr = RoInitialize(RO_INIT_SINGLETHREADED);
+	TraceEnd("RoInitialize");
 	assert(SUCCEEDED(hr));
 	std::cout << "RoInitialize(st): " << hr << std::endl;
 
+	TraceBegin("RoGetActivationFactory");
 	hr = RoGetActivationFactory(HStringReference(L"Windows.Gaming.Input.RacingWheel").Get(), __uuidof(IRacingWheelStatics), &racingWheelStatics);
+	TraceEnd("RoGetActivationFactory");
 	assert(SUCCEEDED(hr));
 	std::cout << "RoGetActivationFactory: " << hr << std::endl;
 	std::cout << "racingWheelStatics: " << racingWheelStatics << std::endl;
 
 	typedef __FIEventHandler_1_Windows__CGaming__CInput__CRacingWheel AddedHandler;
+	TraceBegin("add_RacingWheelAdded");
 	hr = racingWheelStatics->add_RacingWheelAdded(Callback<AddedHandler>(RacingWheelAdded).Get(), &gAddedToken);
+	TraceEnd("add_RacingWheelAdded");
 	assert(SUCCEEDED(hr));
 	std::cout << "add_RacingWheelAdded: " << hr
 		<< ", token=" << gAddedToken.value
 		<< std::endl;
 
 	typedef __FIEventHandler_1_Windows__CGaming__CInput__CRacingWheel RemovedHandler;
+	TraceBegin("add_RacingWheelRemoved");
 	hr = racingWheelStatics->add_RacingWheelRemoved(Callback<RemovedHandler>(RacingWheelRemoved).Get(), &gRemovedToken);
+	TraceEnd("add_RacingWheelRemoved");
 	assert(SUCCEEDED(hr));
 	std::cout << "add_RacingWheelRemoved: " << hr
 		<< ", token=" << gRemovedToken.value
 		<< std::endl;
 
-	// GetConfig();
-
 	ScanRacingWheels();
 
-	return TRUE;
+	StartHaptics();
 }
 
 #pragma endregion
@@ -433,78 +562,465 @@ typedef struct _XINPUT_KEYSTROKE
 
 #define DLLEXPORT extern "C" __declspec(dllexport)
 
+// Reads the wheel and translates the reading into an XINPUT_STATE
+HRESULT ReadRacingWheelState(IRacingWheel* racingWheel, XINPUT_STATE *pState)
+{
+	RacingWheelReading state;
+	HRESULT hr = racingWheel->GetCurrentReading(&state);
+	if (FAILED(hr))
+		return hr;
+
+	DWORD keys = 0;
+
+	//float Wheel = ApplyLinearDeadZone(state.Wheel, 1.f, c_XboxOneThumbDeadZone);
+
+	pState->Gamepad.bRightTrigger = state.Throttle * 255;
+	pState->Gamepad.bLeftTrigger = state.Brake * 255;
+
+	pState->Gamepad.sThumbLX = (state.Wheel >= 0) ? state.Wheel * 32767 : state.Wheel * 32768;
+	pState->Gamepad.sThumbLY = 0;
+
+	pState->Gamepad.sThumbRX = 0;
+	pState->Gamepad.sThumbRY = 0;
+
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button3) != 0) keys += XINPUT_GAMEPAD_A;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button4) != 0) keys += XINPUT_GAMEPAD_B;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button5) != 0) keys += XINPUT_GAMEPAD_X;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button6) != 0) keys += XINPUT_GAMEPAD_Y;
+
+	/*
+	if ((state.Buttons & RacingWheelButtons::GamepadButtons_RightThumbstick) != 0) keys += XINPUT_GAMEPAD_RIGHT_THUMB;
+	if ((state.Buttons & RacingWheelButtons::GamepadButtons_LeftThumbstick) != 0) keys += XINPUT_GAMEPAD_LEFT_THUMB;
+	*/
+
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_PreviousGear) != 0) keys += XINPUT_GAMEPAD_LEFT_SHOULDER;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_NextGear) != 0) keys += XINPUT_GAMEPAD_RIGHT_SHOULDER;
+
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button2) != 0) keys += XINPUT_GAMEPAD_BACK;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button1) != 0) keys += XINPUT_GAMEPAD_START;
+
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadUp) != 0) keys += XINPUT_GAMEPAD_DPAD_UP;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadDown) != 0) keys += XINPUT_GAMEPAD_DPAD_DOWN;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadLeft) != 0) keys += XINPUT_GAMEPAD_DPAD_LEFT;
+	if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadRight) != 0) keys += XINPUT_GAMEPAD_DPAD_RIGHT;
+
+	// Press both shoulder buttons and the start button to reload configuration.
+	/*
+	if ((state.Buttons & RacingWheelButtons::GamepadButtons_RightShoulder) != 0 &&
+		(state.Buttons & RacingWheelButtons::GamepadButtons_LeftShoulder) != 0 &&
+		(state.Buttons & RacingWheelButtons::GamepadButtons_Menu) != 0) {
+		GetConfig();
+	}*/
+
+
+	pState->dwPacketNumber = state.Timestamp;
+	pState->Gamepad.wButtons = keys;
+
+	return S_OK;
+}
+
+// Fills the capabilities reported for a racing wheel
+HRESULT GetRacingWheelCapabilities(IRacingWheel* racingWheel, XINPUT_CAPABILITIES *pCapabilities)
+{
+	ComPtr<IGameController> racingWheelInfo;
+	HRESULT hr = racingWheel->QueryInterface(IID_PPV_ARGS(&racingWheelInfo));
+	if (FAILED(hr))
+		return hr;
+
+	boolean wireless = false;
+	racingWheelInfo->get_IsWireless(&wireless);
+
+	ComPtr<ABI::Windows::Gaming::Input::ForceFeedback::IForceFeedbackMotor> wheelMotor;
+	racingWheel->get_WheelMotor(&wheelMotor);
+
+	pCapabilities->Type = XINPUT_DEVTYPE_GAMEPAD;
+
+	pCapabilities->SubType = XINPUT_DEVSUBTYPE_WHEEL;
+
+	if (wheelMotor) pCapabilities->Flags += XINPUT_CAPS_FFB_SUPPORTED;
+	if (wireless) pCapabilities->Flags += XINPUT_CAPS_WIRELESS;
+
+	return S_OK;
+}
+
 /*
-  Racing wheel controller.
+	Broker mode, see Broker.h.
+	The owner keeps using the wheels directly and publishes every slot from a background thread,
+	the other instances (readers) only look at the shared region.
+*/
+#pragma region Broker
 
-  Left Stick X reports the wheel rotation, 
-  Right Trigger is the acceleration pedal,
-  and Left Trigger is the brake pedal.
+static_assert(BROKER_SLOT_COUNT == MAX_PLAYER_COUNT, "Broker slots must match racingWheels");
 
-  Includes Directional Pad and most standard buttons (A, B, X, Y, START, BACK, LB, RB). LSB and RSB are optional.
-  https://docs.microsoft.com/en-us/windows/win32/xinput/xinput-and-controller-subtypes
- */
-DLLEXPORT DWORD WINAPI XInputGetState(_In_ DWORD dwUserIndex, _Out_ XINPUT_STATE *pState)
+BrokerRegion* gBroker = NULL;
+std::atomic<bool> gBrokerOwner(false);
+std::atomic<bool> gBrokerStop(false);
+bool gWinRTInitialized = false;
+
+bool IsBrokerReader()
 {
-	InitializeRacingWheel();
-	//std::cout << "XInputGetState" << std::endl;
+	return gBroker != NULL && !gBrokerOwner.load(std::memory_order_acquire);
+}
+
+// Capabilities only change when a wheel comes or goes, they are queried once per scan.
+// Only touched by the thread publishing.
+XINPUT_CAPABILITIES gPublishedCapabilities[MAX_PLAYER_COUNT];
+bool gPublishedCapabilitiesValid[MAX_PLAYER_COUNT];
+uint32_t gPublishedKeys[MAX_PLAYER_COUNT];	// Generation the capabilities belong to plus one, 0 to query again
+
+void PublishRacingWheels()
+{
+	for (size_t i = 0; i < MAX_PLAYER_COUNT; ++i)
+	{
+		XINPUT_STATE state = {};
+
+		// A scan may swap the wheel in this slot for another before its closing bump, so the
+		// cached capabilities are only the borrowed wheel's if no scan ran around the borrow.
+		// Sequentially consistent like the slot exchange: a borrow seeing a scan's wheel sees it started.
+		uint32_t before = gScanGeneration.load(std::memory_order_seq_cst);
+		RacingWheelBorrow racingWheel(racingWheels, i);
+		uint32_t after = gScanGeneration.load(std::memory_order_seq_cst);
+		bool settled = before == after && !(before & 1);
+
+		if (!settled || gPublishedKeys[i] != before + 1)
+		{
+			gPublishedKeys[i] = settled ? before + 1 : 0;
+			gPublishedCapabilities[i] = XINPUT_CAPABILITIES();
+			gPublishedCapabilitiesValid[i] = racingWheel.Get() &&
+				SUCCEEDED(GetRacingWheelCapabilities(racingWheel.Get(), &gPublishedCapabilities[i]));
+		}
+
+		bool connected = racingWheel.Get() && gPublishedCapabilitiesValid[i] &&
+			SUCCEEDED(ReadRacingWheelState(racingWheel.Get(), &state));
+
+		BrokerPublish(gBroker, i, connected, state, gPublishedCapabilities[i]);
+	}
+}
+
+// Plays what the readers' XInputSetState left in the region, the owner does their haptics
+void ForwardBrokerVibration()
+{
+	if (!HapticsEnabled)
+		return;
+
+	for (size_t i = 0; i < MAX_PLAYER_COUNT; ++i)
+	{
+		uint16_t leftSpeed, rightSpeed;
+		if (BrokerTakeVibration(gBroker, i, &leftSpeed, &rightSpeed))
+			HapticsSubmit(&gHaptics, i, leftSpeed, rightSpeed);
+	}
+}
+
+// Polls and publishes while this process owns the region, otherwise waits for the owner to go away
+DWORD WINAPI BrokerThread(LPVOID)
+{
+	const uint32_t id = BrokerProcessId();
+	bool fineTimer = false;
+
+	while (!gBrokerStop.load(std::memory_order_acquire))
+	{
+		uint64_t now = BrokerNow();
+		bool owner = BrokerTryAcquire(gBroker, id, now, BrokerOwnerTimeout);
+
+		if (owner)
+		{
+			if (!gWinRTInitialized)
+			{
+				std::cout << "Broker: took over ownership" << std::endl;
+				InitializeWinRT();
+				gWinRTInitialized = true;
+			}
+
+			BrokerHeartbeat(gBroker, now);
+			PublishRacingWheels();
+			ForwardBrokerVibration();
+		}
+
+		gBrokerOwner.store(owner, std::memory_order_release);
+
+		// Readers get their input from this thread, at the default 15.6ms timer resolution
+		// PollInterval would be rounded up to 64Hz. Only the owner needs the finer resolution.
+		if (owner != fineTimer)
+		{
+			if (owner)
+				timeBeginPeriod(1);
+			else
+				timeEndPeriod(1);
+			fineTimer = owner;
+		}
+
+		Sleep(owner ? BrokerPollInterval : BrokerOwnerTimeout / 4);
+	}
+
+	if (fineTimer)
+		timeEndPeriod(1);
+
+	return 0;
+}
+
+bool StartBroker()
+{
+	gBroker = BrokerOpen(BROKER_DEFAULT_NAME);
+	std::cout << "BrokerOpen: " << gBroker << std::endl;
+	if (!gBroker)
+		return false;
+
+	// The broker thread runs until the process exits, so the DLL must never be unloaded under it
+	PinModule();
+
+	// Claim on the calling thread so the first XInputGetState already knows which side it's on
+	if (BrokerTryAcquire(gBroker, BrokerProcessId(), BrokerNow(), BrokerOwnerTimeout))
+	{
+		std::cout << "Broker: owner" << std::endl;
+		InitializeWinRT();
+		gWinRTInitialized = true;
+		BrokerHeartbeat(gBroker, BrokerNow());
+		PublishRacingWheels();
+		gBrokerOwner.store(true, std::memory_order_release);
+	}
+	else
+	{
+		std::cout << "Broker: reader" << std::endl;
+	}
+
+	HANDLE thread = CreateThread(NULL, 0, BrokerThread, NULL, 0, NULL);
+	if (thread)
+		CloseHandle(thread);
+
+	return true;
+}
+
+// Called on process detach, hands the region over to the next instance right away
+void StopBroker()
+{
+	if (!gBroker)
+		return;
+
+	gBrokerStop.store(true, std::memory_order_release);
+
+	// A reader exiting (e.g. an overlay) must leave the owner's slots alone
+	if (gBrokerOwner.load(std::memory_order_acquire))
+		BrokerRelease(gBroker, BrokerProcessId());
+}
+
+DWORD BrokerGetState(DWORD dwUserIndex, XINPUT_STATE *pState)
+{
+	XINPUT_CAPABILITIES capabilities;
+	if (dwUserIndex >= BROKER_SLOT_COUNT || !BrokerRead(gBroker, dwUserIndex, pState, &capabilities))
+		return ERROR_DEVICE_NOT_CONNECTED;
+
+	return ERROR_SUCCESS;
+}
 
-	if (racingWheels[dwUserIndex] == NULL) {
+DWORD BrokerGetCapabilities(DWORD dwUserIndex, XINPUT_CAPABILITIES *pCapabilities)
+{
+	XINPUT_STATE state;
+	if (dwUserIndex >= BROKER_SLOT_COUNT || !BrokerRead(gBroker, dwUserIndex, &state, pCapabilities))
 		return ERROR_DEVICE_NOT_CONNECTED;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD BrokerGetConnected(DWORD dwUserIndex)
+{
+	XINPUT_STATE state;
+	return BrokerGetState(dwUserIndex, &state);
+}
+
+#pragma endregion
+
+/*
+	Timeline tracing, see Trace.h.
+	Written when the process exits or when TriggerKey is pressed, one file per process.
+	A TriggerKey press is only noticed on the game thread, the file is written on a thread of its own
+	so the game doesn't stall on the disk.
+*/
+#pragma region Trace
+
+HANDLE gTraceWriteRequest = NULL;
+
+void WriteTrace()
+{
+	char path[MAX_PATH];
+	sprintf_s(path, ".\\X1nput.trace.%u.json", GetCurrentProcessId());
+
+	bool written = TraceWrite(path);
+	std::cout << "TraceWrite " << path << ": " << written << std::endl;
+}
+
+DWORD WINAPI TraceWriterThread(LPVOID)
+{
+	while (WaitForSingleObject(gTraceWriteRequest, INFINITE) == WAIT_OBJECT_0)
+		WriteTrace();
+
+	return 0;
+}
+
+void StartTraceWriter()
+{
+	if (!TraceEnabled() || TraceTriggerKey == 0)
+		return;
+
+	gTraceWriteRequest = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (gTraceWriteRequest == NULL)
+		return;
+
+	// The writer thread waits until the process exits
+	PinModule();
+
+	HANDLE thread = CreateThread(NULL, 0, TraceWriterThread, NULL, 0, NULL);
+	if (thread)
+		CloseHandle(thread);
+}
+
+// Only checked on sampled calls, GetAsyncKeyState remembers presses in between
+void PollTraceTrigger()
+{
+	if (gTraceWriteRequest != NULL && (GetAsyncKeyState(TraceTriggerKey) & 1) != 0)
+	{
+		// Only on a key press, but SetEvent does lock the event inside the kernel
+		ALLOCTRACK_NOTE_LOCK();
+		SetEvent(gTraceWriteRequest);
 	}
+}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+#pragma endregion
 
-	RacingWheelReading state;
-	HRESULT hr = racingWheel->GetCurrentReading(&state);
+#ifdef X1NPUT_ALLOC_TRACKING
+// Debug builds print how often the per-frame exports allocated or locked after warm-up, see AllocTrack.h
+void ReportAllocTracking()
+{
+	for (int i = 0; i < ALLOCTRACK_EXPORT_COUNT; ++i)
+	{
+		const AllocTrackStats& stats = AllocTrackGetStats(static_cast<AllocTrackExport>(i));
+		std::cout << AllocTrackExportName(static_cast<AllocTrackExport>(i))
+			<< ": calls=" << stats.calls
+			<< ", violations=" << stats.violations
+			<< ", allocations=" << stats.allocations
+			<< ", locks=" << stats.locks
+			<< std::endl;
+	}
+}
+#endif
 
-	if (SUCCEEDED(hr)) {
+/*
+	Haptics output, see Haptics.h.
+*/
+#pragma region Haptics
 
-		DWORD keys = 0;
+static_assert(HAPTICS_SLOT_COUNT == MAX_PLAYER_COUNT, "Haptics slots must match racingWheels");
 
-		//float Wheel = ApplyLinearDeadZone(state.Wheel, 1.f, c_XboxOneThumbDeadZone);
+ComPtr<IGamepadStatics2> gamepadStatics;
+bool gHapticsStarted = false;
 
-		pState->Gamepad.bRightTrigger = state.Throttle * 255;
-		pState->Gamepad.bLeftTrigger = state.Brake * 255;
+// Gamepad views of the wheels, only touched on the haptics timer thread.
+// Looked up again whenever ScanRacingWheels ran, not on every tick.
+ComPtr<IGamepad> gHapticsGamepads[MAX_PLAYER_COUNT];
+uint32_t gHapticsGenerations[MAX_PLAYER_COUNT];
 
-		pState->Gamepad.sThumbLX = (state.Wheel >= 0) ? state.Wheel * 32767 : state.Wheel * 32768;
-		pState->Gamepad.sThumbLY = 0;
+// The RacingWheel class has no rumble motors or impulse triggers of its own.
+// Wheels that have them are also exposed as a Gamepad, everything else is skipped.
+void RacingWheelVibrationSink(void*, size_t slot, const HapticsFrame& frame)
+{
+	uint32_t generation = gScanGeneration.load(std::memory_order_acquire);
+	if (generation != gHapticsGenerations[slot])
+	{
+		gHapticsGenerations[slot] = generation;
+		gHapticsGamepads[slot].Reset();
 
-		pState->Gamepad.sThumbRX = 0;
-		pState->Gamepad.sThumbRY = 0;
+		RacingWheelBorrow racingWheel(racingWheels, slot);
 
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button3) != 0) keys += XINPUT_GAMEPAD_A;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button4) != 0) keys += XINPUT_GAMEPAD_B;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button5) != 0) keys += XINPUT_GAMEPAD_X;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button6) != 0) keys += XINPUT_GAMEPAD_Y;
+		ComPtr<IGameController> controller;
+		if (racingWheel.Get() && SUCCEEDED(racingWheel->QueryInterface(IID_PPV_ARGS(&controller))))
+			gamepadStatics->FromGameController(controller.Get(), &gHapticsGamepads[slot]);
+	}
 
-		/*
-		if ((state.Buttons & RacingWheelButtons::GamepadButtons_RightThumbstick) != 0) keys += XINPUT_GAMEPAD_RIGHT_THUMB;
-		if ((state.Buttons & RacingWheelButtons::GamepadButtons_LeftThumbstick) != 0) keys += XINPUT_GAMEPAD_LEFT_THUMB;
-		*/
+	IGamepad* gamepad = gHapticsGamepads[slot].Get();
+	if (!gamepad)
+		return;
 
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_PreviousGear) != 0) keys += XINPUT_GAMEPAD_LEFT_SHOULDER;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_NextGear) != 0) keys += XINPUT_GAMEPAD_RIGHT_SHOULDER;
+	GamepadVibration vibration;
+	vibration.LeftMotor = frame.LeftMotor;
+	vibration.RightMotor = frame.RightMotor;
+	vibration.LeftTrigger = frame.LeftTrigger;
+	vibration.RightTrigger = frame.RightTrigger;
 
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button2) != 0) keys += XINPUT_GAMEPAD_BACK;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_Button1) != 0) keys += XINPUT_GAMEPAD_START;
+	gamepad->put_Vibration(vibration);
+}
 
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadUp) != 0) keys += XINPUT_GAMEPAD_DPAD_UP;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadDown) != 0) keys += XINPUT_GAMEPAD_DPAD_DOWN;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadLeft) != 0) keys += XINPUT_GAMEPAD_DPAD_LEFT;
-		if ((state.Buttons & RacingWheelButtons::RacingWheelButtons_DPadRight) != 0) keys += XINPUT_GAMEPAD_DPAD_RIGHT;
+void StartHaptics()
+{
+	if (!HapticsEnabled)
+		return;
 
-		// Press both shoulder buttons and the start button to reload configuration.
-		/*
-		if ((state.Buttons & RacingWheelButtons::GamepadButtons_RightShoulder) != 0 &&
-			(state.Buttons & RacingWheelButtons::GamepadButtons_LeftShoulder) != 0 &&
-			(state.Buttons & RacingWheelButtons::GamepadButtons_Menu) != 0) {
-			GetConfig();
-		}*/
+	TraceBegin("RoGetActivationFactory");
+	HRESULT hr = RoGetActivationFactory(HStringReference(L"Windows.Gaming.Input.Gamepad").Get(), __uuidof(IGamepadStatics2), &gamepadStatics);
+	TraceEnd("RoGetActivationFactory");
+	std::cout << "RoGetActivationFactory(Gamepad): " << hr << std::endl;
+	if (FAILED(hr))
+		return;
 
+	// The default 15.6ms timer resolution would cap the update rate at 64Hz
+	timeBeginPeriod(1);
 
-		pState->dwPacketNumber = state.Timestamp;
-		pState->Gamepad.wButtons = keys;
+	PinModule();
 
+	HapticsReset(&gHaptics);
+	HapticsStart(&gHaptics, HapticsUpdateRate, RacingWheelVibrationSink, NULL);
+	gHapticsStarted = true;
+	std::cout << "Haptics: " << HapticsUpdateRate << "Hz" << std::endl;
+}
+
+// Called on process detach, before the CRT destroys gHaptics: destroying a joinable std::thread terminates the process.
+// The module is pinned, so this only happens at process exit, where the timer thread is already gone and the join returns at once.
+void StopHaptics()
+{
+	if (!gHapticsStarted)
+		return;
+
+	HapticsStop(&gHaptics);
+	timeEndPeriod(1);
+	gHapticsStarted = false;
+}
+
+#pragma endregion
+
+/*
+  Racing wheel controller.
+
+  Left Stick X reports the wheel rotation, 
+  Right Trigger is the acceleration pedal,
+  and Left Trigger is the brake pedal.
+
+  Includes Directional Pad and most standard buttons (A, B, X, Y, START, BACK, LB, RB). LSB and RSB are optional.
+  https://docs.microsoft.com/en-us/windows/win32/xinput/xinput-and-controller-subtypes
+ */
+DLLEXPORT DWORD WINAPI XInputGetState(_In_ DWORD dwUserIndex, _Out_ XINPUT_STATE *pState)
+{
+	ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE);
+
+	InitializeRacingWheel();
+	//std::cout << "XInputGetState" << std::endl;
+
+	bool sampled = TraceSample();
+	TraceScope trace("XInputGetState", sampled);
+	if (sampled)
+		PollTraceTrigger();
+
+	if (IsBrokerReader()) {
+		return BrokerGetState(dwUserIndex, pState);
+	}
+
+	// Borrowed from racingWheels without refcount traffic, out-of-range indices come back empty
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	HRESULT hr = ReadRacingWheelState(racingWheel.Get(), pState);
+
+	if (SUCCEEDED(hr)) {
 		return ERROR_SUCCESS;
 	}
 	else
@@ -516,14 +1032,26 @@ DLLEXPORT DWORD WINAPI XInputGetState(_In_ DWORD dwUserIndex, _Out_ XINPUT_STATE
 
 DLLEXPORT DWORD WINAPI XInputSetState(_In_ DWORD dwUserIndex, _In_ XINPUT_VIBRATION *pVibration)
 {
+	ALLOCTRACK_SCOPE(ALLOCTRACK_SET_STATE);
+
 	InitializeRacingWheel();
 	//std::cout << "XInputSetState" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	TraceScope trace("XInputSetState", TraceSample());
+
+	if (IsBrokerReader()) {
+		DWORD result = BrokerGetConnected(dwUserIndex);
+		if (result == ERROR_SUCCESS)
+			BrokerSubmitVibration(gBroker, dwUserIndex, pVibration->wLeftMotorSpeed, pVibration->wRightMotorSpeed);
+		return result;
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	// Borrowed from racingWheels, see XInputGetState
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -533,20 +1061,12 @@ DLLEXPORT DWORD WINAPI XInputSetState(_In_ DWORD dwUserIndex, _In_ XINPUT_VIBRAT
 		/*
 			TODO: support wheel motor FFB:
 			https://docs.microsoft.com/en-us/windows/uwp/gaming/racing-wheel-and-force-feedback
-			GamepadVibration vibration;
-
-			float LSpeed = pVibration->wLeftMotorSpeed / 65535.0f;
-			float RSpeed = pVibration->wRightMotorSpeed / 65535.0f;
-
-			vibration.LeftMotor = MotorSwap ? RSpeed * LMotorStrength : LSpeed * LMotorStrength;
-			vibration.RightMotor = MotorSwap ? LSpeed * RMotorStrength : RSpeed * RMotorStrength;
-
-			vibration.LeftTrigger = TriggerSwap ? RSpeed * LTriggerStrength : LSpeed * LTriggerStrength;
-			vibration.RightTrigger = TriggerSwap ? LSpeed * RTriggerStrength : RSpeed * RTriggerStrength;
-
-			racingWheel->put_Vibration(vibration);
 		*/
 
+		// The haptics timer turns the command into motor and trigger envelopes, see Haptics.h
+		if (HapticsEnabled)
+			HapticsSubmit(&gHaptics, dwUserIndex, pVibration->wLeftMotorSpeed, pVibration->wRightMotorSpeed);
+
 		return ERROR_SUCCESS;
 	}
 
@@ -562,32 +1082,23 @@ DLLEXPORT DWORD WINAPI XInputGetCapabilities(_In_ DWORD dwUserIndex, _In_ DWORD
 	InitializeRacingWheel();
 	std::cout << "XInputGetCapabilities" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	TraceScope trace("XInputGetCapabilities", TraceSample());
+
+	if (IsBrokerReader()) {
+		return BrokerGetCapabilities(dwUserIndex, pCapabilities);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
 
 	if (SUCCEEDED(hr)) {
-
-		ComPtr<IGameController> racingWheelInfo;
-		racingWheels[dwUserIndex].As(&racingWheelInfo);
-
-		boolean wireless;
-		racingWheelInfo->get_IsWireless(&wireless);
-
-		ABI::Windows::Gaming::Input::ForceFeedback::IForceFeedbackMotor* wheelMotor;
-		racingWheel->get_WheelMotor(&wheelMotor);
-
-		pCapabilities->Type = XINPUT_DEVTYPE_GAMEPAD;
-
-		pCapabilities->SubType = XINPUT_DEVSUBTYPE_WHEEL;
-
-		if (wheelMotor) pCapabilities->Flags += XINPUT_CAPS_FFB_SUPPORTED;
-		if (wireless) pCapabilities->Flags += XINPUT_CAPS_WIRELESS;
+		GetRacingWheelCapabilities(racingWheel.Get(), pCapabilities);
 
 		return ERROR_SUCCESS;
 	}
@@ -602,6 +1113,11 @@ DLLEXPORT void WINAPI XInputEnable(_In_ BOOL enable)
 	InitializeRacingWheel();
 
 	std::cout << "XInputEnable" << std::endl;
+
+	// Readers have no WinRT state, the owner rescans on hotplug events
+	if (IsBrokerReader())
+		return;
+
 	ScanRacingWheels();
 }
 
@@ -610,11 +1126,15 @@ DLLEXPORT DWORD WINAPI XInputGetDSoundAudioDeviceGuids(DWORD dwUserIndex, GUID*
 	InitializeRacingWheel();
 	std::cout << "XInputGetDSoundAudioDeviceGuids" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -633,11 +1153,15 @@ DLLEXPORT DWORD WINAPI XInputGetBatteryInformation(_In_ DWORD dwUserIndex, _In_
 	InitializeRacingWheel();
 	std::cout << "XInputGetBatteryInformation" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -682,12 +1206,18 @@ DLLEXPORT DWORD WINAPI XInputGetKeystroke(DWORD dwUserIndex, DWORD dwReserved, P
 	InitializeRacingWheel();
 	std::cout << "XInputGetKeystroke" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
+	}
+
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
 		return ERROR_DEVICE_NOT_CONNECTED;
 	}
 
 	RacingWheelReading state;
-	HRESULT hr = racingWheels[dwUserIndex]->GetCurrentReading(&state);
+	HRESULT hr = racingWheel->GetCurrentReading(&state);
 
 	if (SUCCEEDED(hr)) {
 		return ERROR_SUCCESS;
@@ -700,6 +1230,8 @@ DLLEXPORT DWORD WINAPI XInputGetKeystroke(DWORD dwUserIndex, DWORD dwReserved, P
 
 DLLEXPORT DWORD WINAPI XInputGetStateEx(_In_ DWORD dwUserIndex, _Out_ XINPUT_STATE *pState)
 {
+	ALLOCTRACK_SCOPE(ALLOCTRACK_GET_STATE_EX);
+
 	return XInputGetState(dwUserIndex, pState);
 }
 
@@ -708,11 +1240,15 @@ DLLEXPORT DWORD WINAPI XInputWaitForGuideButton(_In_ DWORD dwUserIndex, _In_ DWO
 	InitializeRacingWheel();
 	std::cout << "XInputWaitForGuideButton" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -731,11 +1267,15 @@ DLLEXPORT DWORD XInputCancelGuideButtonWait(_In_ DWORD dwUserIndex)
 	InitializeRacingWheel();
 	std::cout << "XInputCancelGuideButtonWait" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -754,11 +1294,15 @@ DLLEXPORT DWORD XInputPowerOffController(_In_ DWORD dwUserIndex)
 	InitializeRacingWheel();
 	std::cout << "XInputPowerOffController" << std::endl;
 
-	if (racingWheels[dwUserIndex] == NULL) {
-		return ERROR_DEVICE_NOT_CONNECTED;
+	if (IsBrokerReader()) {
+		return BrokerGetConnected(dwUserIndex);
 	}
 
-	auto racingWheel = racingWheels[dwUserIndex];
+	RacingWheelBorrow racingWheel(racingWheels, dwUserIndex);
+
+	if (racingWheel.Get() == NULL) {
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
 
 	RacingWheelReading state;
 	HRESULT hr = racingWheel->GetCurrentReading(&state);
@@ -771,3 +1315,22 @@ DLLEXPORT DWORD XInputPowerOffController(_In_ DWORD dwUserIndex)
 		return ERROR_DEVICE_NOT_CONNECTED;
 	}
 }
+
+BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
+{
+	switch (ul_reason_for_call)
+	{
+	case DLL_PROCESS_DETACH:
+		StopBroker();
+		StopHaptics();
+
+		if (TraceEnabled())
+			WriteTrace();
+
+#ifdef X1NPUT_ALLOC_TRACKING
+		ReportAllocTracking();
+#endif
+		break;
+	}
+	return TRUE;
+}
@@ -11,6 +11,7 @@
 #define NOMINMAX
 // Windows Header Files
 #include <windows.h>
+#include <timeapi.h>
 
 
 
@@ -24,4 +25,10 @@
 #include <wrl.h>
 #include <algorithm>
 #include <windows.gaming.input.h>
-#pragma comment(lib, "runtimeobject.lib")
\ No newline at end of file
+#include "AllocTrack.h"
+#include "Broker.h"
+#include "DeviceSlots.h"
+#include "Haptics.h"
+#include "Trace.h"
+#pragma comment(lib, "runtimeobject.lib")
+#pragma comment(lib, "winmm.lib")
\ No newline at end of file